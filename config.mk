@@ -11,15 +11,20 @@ X11LIB = /usr/lib/X11
 # XRandR for multi-monitor support
 XRANDRLIBS = -lXrandr
 
+# Composite and Damage for overlay thumbnails
+COMPOSITELIBS = -lXcomposite -lXdamage
+
 # freetype
 FREETYPELIBS = -lfontconfig -lXft
 FREETYPEINC = /usr/include/freetype2
 
 # includes and libs
 INCS = -I${X11INC} -I${FREETYPEINC}
-LIBS = -L${X11LIB} -lX11 ${XRANDRLIBS} ${FREETYPELIBS} -lXrender
+LIBS = -L${X11LIB} -lX11 -lXext ${XRANDRLIBS} ${COMPOSITELIBS} ${FREETYPELIBS} -lXrender
 
 # flags
+# The window hit tests use SSE2 where the compiler targets it; add
+# -mavx2 (or -march=native) to CFLAGS for the 8-lane path.
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_POSIX_C_SOURCE=200809L -DVERSION=\"${VERSION}\"
 CFLAGS   = -std=c99 -pedantic -Wall -Wno-deprecated-declarations -Os ${INCS} ${CPPFLAGS}
 LDFLAGS  = ${LIBS}
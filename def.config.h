@@ -6,17 +6,31 @@
 static const unsigned int border_width = 2;
 static const unsigned int padding = 10;
 
+/* raise windows when they get focus (also on mouse hover) */
+static const int focus_raises = 1;
+
+/* keep windows of hidden workspaces mapped and move them off-screen
+ * instead of unmapping them (faster switches for GL/Electron clients) */
+static const int park_hidden = 0;
+
 /* colors */
 static const char col_background[]    = "#1e1e2e";
 static const char col_foreground[]    = "#cdd6f4";
 static const char col_selection[]     = "#89b4fa";
 static const char col_border_normal[] = "#313244";
 static const char col_border_focused[]= "#89b4fa";
+static const char col_border_marked[] = "#f38ba8";
 static const char root_bg[]           = "#1e1e2e";
 
 /* font for overlay */
 static const char overlay_font[] = "monospace:size=24:antialias=true";
 
+/* overlay thumbnails: show a scaled copy of each window in the cells it
+ * covers (needs the Composite and Damage extensions); thumb_scale is the
+ * size of a thumbnail relative to the window */
+static const int overlay_thumbnails = 0;
+static const float thumb_scale = 0.6;
+
 /* grid layout */
 #define GRID_ROWS 3
 #define GRID_COLS 4
@@ -28,9 +42,43 @@ static const char grid_chars[GRID_ROWS][GRID_COLS] = {
 	{'z', 'x', 'c', 'v'}
 };
 
+/* where new windows go: PlaceFirstCell (first free cell) or
+ * PlaceLargestSpan (the largest empty rectangle of cells) */
+static const int placement = PlaceFirstCell;
+
+/* clients with _NET_WM_SYNC_REQUEST get one resize at a time; stop
+ * waiting for a client that hasn't repainted after this long (pacing is
+ * dropped after a few misses in a row) */
+static const unsigned int sync_timeout_ms = 200;
+
+/* monitor hotplug: RandR changes are applied once none arrived for this long */
+static const unsigned int hotplug_settle_ms = 250;
+
+/* window rules: the first matching rule places a new window before it is
+ * mapped. NULL fields match anything; ws and monitor -1 mean the current
+ * one; cells are two grid labels, as typed in the overlay. Rules on role
+ * or type cost an extra round trip per new window. */
+static const Rule rules[] = {
+	/* class          instance  role  type  ws  monitor  cells  fullscreen */
+	{ NULL,           NULL,     NULL, NULL, -1, -1,      NULL,  0 },  /* placeholder, ignored */
+	/* examples:
+	{ "mpv",          NULL,     NULL, NULL, -1, -1,      NULL,  1 },
+	{ "Pavucontrol",  NULL,     NULL, NULL, -1, -1,      "rf",  0 },
+	*/
+};
+
 /* modifier key - Mod4Mask is Super/Windows key */
 #define MODKEY Mod4Mask
 
+/* mouse drag: window geometry updates per second while moving/resizing */
+static const unsigned int drag_refresh_hz = 60;
+
+/* placement chords: hold place_mod and type two grid keys to place the
+ * focused window without the overlay; the overlay only shows if the
+ * second key doesn't follow within chord_timeout_ms */
+static const unsigned int place_mod = MODKEY|Mod1Mask;
+static const unsigned int chord_timeout_ms = 400;
+
 /* helper macros for launching applications */
 #define SHCMD(cmd) { .v = (const char*[]){ "/bin/sh", "-c", cmd, NULL } }
 
@@ -40,6 +88,14 @@ static const char grid_chars[GRID_ROWS][GRID_COLS] = {
 static const char *termcmd[]  = { "alacritty", NULL };
 static const char *menucmd[]  = { "rofi", "-show", "drun", NULL };
 
+/* warm pools: keep size instances of a spawn command started and hidden,
+ * so its key only has to show one (0 disables; needs _NET_WM_PID). Menus
+ * that grab the keyboard when they start can't be pooled. */
+static const Pool pools[] = {
+	/* command     size */
+	{ termcmd,     0 },
+};
+
 /* key bindings */
 static Key keys[] = {
 	/* modifier          key              function           argument */
@@ -53,12 +109,26 @@ static Key keys[] = {
 	{ MODKEY,            XK_f,            toggle_fullscreen, {0} },
 	{ MODKEY,            XK_space,        enter_overlay,     {0} },
 	
+	/* selection: marked windows are moved, placed or killed together */
+	{ MODKEY,            XK_m,            togglemark,        {0} },
+	{ MODKEY|ShiftMask,  XK_m,            clearmarks,        {0} },
+	
 	/* focus cycling */
 	{ MODKEY,            XK_j,            cycle_focus,       {0} },
 	{ MODKEY,            XK_k,            cycle_focus_backward, {0} },
 	{ MODKEY,            XK_Tab,          cycle_focus,       {0} },
 	{ MODKEY|ShiftMask,  XK_Tab,          cycle_focus_backward, {0} },
 	
+	/* directional focus and swap, crossing onto adjacent monitors */
+	{ MODKEY,            XK_Left,         focusdir,          {.i = DirLeft} },
+	{ MODKEY,            XK_Right,        focusdir,          {.i = DirRight} },
+	{ MODKEY,            XK_Up,           focusdir,          {.i = DirUp} },
+	{ MODKEY,            XK_Down,         focusdir,          {.i = DirDown} },
+	{ MODKEY|ShiftMask,  XK_Left,         swapdir,           {.i = DirLeft} },
+	{ MODKEY|ShiftMask,  XK_Right,        swapdir,           {.i = DirRight} },
+	{ MODKEY|ShiftMask,  XK_Up,           swapdir,           {.i = DirUp} },
+	{ MODKEY|ShiftMask,  XK_Down,         swapdir,           {.i = DirDown} },
+	
 	/* workspace switching */
 	{ MODKEY,            XK_1,            switchws,          {.i = 0} },
 	{ MODKEY,            XK_2,            switchws,          {.i = 1} },
@@ -81,6 +151,10 @@ static Key keys[] = {
 	{ MODKEY|ShiftMask,  XK_8,            movewin_to_ws,     {.i = 7} },
 	{ MODKEY|ShiftMask,  XK_9,            movewin_to_ws,     {.i = 8} },
 	
+	/* layout snapshots */
+	{ MODKEY|ControlMask, XK_s,           savelayout,        {.v = "default"} },
+	{ MODKEY|ControlMask, XK_l,           restorelayout,     {.v = "default"} },
+	
 	/* multi-monitor support */
 	{ MODKEY,            XK_comma,        focus_monitor,     {.i = -1} },  // focus previous monitor
 	{ MODKEY,            XK_period,       focus_monitor,     {.i = +1} },  // focus next monitor
@@ -89,4 +163,11 @@ static Key keys[] = {
 	
 	/* quit */
 	{ MODKEY|ShiftMask,  XK_BackSpace,    quit,              {0} },
-};
\ No newline at end of file
+};
+
+/* mouse bindings (on client windows) */
+static Button buttons[] = {
+	/* modifier          button           function           argument */
+	{ MODKEY,            Button1,         movemouse,         {0} },
+	{ MODKEY,            Button3,         resizemouse,       {0} },
+};
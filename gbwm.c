@@ -9,14 +9,26 @@
 #include <X11/cursorfont.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/sync.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct Client Client;
 struct Client {
@@ -26,13 +38,45 @@ struct Client {
 	int isfullscreen;
 	int workspace;
 	int mapped;  // Track if window is actually visible
+	int ignore_unmap;  // UnmapNotify events caused by our own XUnmapWindow
+	unsigned long stackseq;  // Raise order within a stacking layer, higher is on top
+	int marked;  // Part of the selection that batch actions apply to
+	struct { int x, y, w, h, r1, c1, r2, c2; } home;  // Head and cell span before a hotplug
+	int displaced;  // Moved off a head that went away; goes back when it returns
+	Damage damage;  // Overlay thumbnail: reports changes to the window, 0 if unused
+	XRenderPictFormat *format;  // of the window's visual
+	Pixmap thumb;   // Scaled copy, re-rendered only after damage
+	int thumbw, thumbh, thumbdirty;
+	int protocols;  // ProtoDelete | ProtoTakeFocus | ProtoSync, cached from WM_PROTOCOLS
+	XSyncCounter synccounter;  // _NET_WM_SYNC_REQUEST counter, None if not used
+	XSyncAlarm syncalarm;      // Fires when the client has caught up with a resize
+	unsigned long long syncvalue;  // Counter value last asked for
+	uint64_t syncdeadline;     // Waiting for the client until here (ns), 0 if not
+	int syncpending;           // Geometry changed while waiting
+	int synctimeouts;          // Sync requests in a row that timed out
+	int sentw, senth;          // Size last sent to the server
 	Client *next;
 };
 
+#define GRID_MAX 16  // upper bound for GRID_ROWS and GRID_COLS
+
 typedef struct Monitor Monitor;
 struct Monitor {
 	int x, y, w, h;
 	int num;
+	int ws;                // Workspace shown on this monitor
+	Window overlay;        // Grid overlay, pre-rendered into its background
+	XftDraw *overlay_draw;
+	int sat[GRID_MAX + 1][GRID_MAX + 1];  // Summed-area table of occupied cells
+	Window *stack;         // Stacking order last sent to the server, top first
+	int nstack, stackcap;
+	Client *cells[GRID_MAX][GRID_MAX];  // Topmost shown client per cell
+	int cells_ws;          // Workspace, generation and last stackseq cells[] was built for
+	unsigned int cells_gen;
+	unsigned long cells_seq;  // Raising a window changes the owner of overlapped cells
+	Client *fullscreen;    // Fullscreen window shown here; see fullscreenon()
+	int fs_ws;
+	unsigned int fs_gen;
 	Monitor *next;
 };
 
@@ -50,30 +94,102 @@ typedef struct {
 	const Arg arg;
 } Key;
 
+typedef struct {
+	unsigned int mask;
+	unsigned int button;
+	void (*func)(const Arg *);
+	const Arg arg;
+} Button;
+
+// Window rule: where a new window goes, decided before it is first mapped
+typedef struct {
+	const char *class;     // WM_CLASS class, NULL matches any
+	const char *instance;  // WM_CLASS instance, NULL matches any
+	const char *role;      // WM_WINDOW_ROLE, NULL matches any
+	const char *type;      // _NET_WM_WINDOW_TYPE without the prefix ("DIALOG"), NULL matches any
+	int ws;                // Workspace 0-8, -1 for the one shown on the monitor
+	int monitor;           // Monitor number, -1 for the current monitor
+	const char *cells;     // Two grid labels for the cell span, NULL to place as usual
+	int fullscreen;
+} Rule;
+
+// Warm pool: instances of a spawn command kept started and hidden
+typedef struct {
+	const char **cmd;   // The same array keys[] passes to spawn
+	unsigned int size;  // Instances to keep ready, at most POOLMAX
+} Pool;
+
+#define POOLMAX 4
+#define SYNC_MAX_TIMEOUTS 3  // Stop pacing a client that missed this many in a row
+
+// WM_PROTOCOLS a client supports
+enum { ProtoDelete = 1, ProtoTakeFocus = 2, ProtoSync = 4 };
+
+// Placement policies for new windows
+enum { PlaceFirstCell, PlaceLargestSpan };
+
+// Directions for focusdir() and swapdir()
+enum { DirLeft, DirRight, DirUp, DirDown };
+
+#define LENGTH(X) (sizeof(X) / sizeof((X)[0]))
+
+// Modifiers that take part in key matching (Lock and NumLock are ignored)
+#define CLEANMASK(mask) ((mask) & (ShiftMask|ControlMask|Mod1Mask|Mod3Mask|Mod4Mask|Mod5Mask))
+#define MODSLOTS 8  // distinct modifier combinations usable in keys[]
+
 static Display *dpy;
 static Window root;
 static int screen;
 static Client *workspaces[9] = {NULL};  // 9 workspaces
 static Client *last_focused[9] = {NULL};
-static int current_ws = 0;
+static int current_ws = 0;  // Workspace of current_monitor
 static Client *focused = NULL;
 static int sw, sh;
 static int overlay_mode = 0;
 static char overlay_input[3] = {0};
-static Window overlay_win = 0;
+static uint64_t chord_deadline = 0;  // Pending placement chord times out here (ns), 0 if none
+static Monitor *overlay_mon = NULL;  // Monitor whose overlay is shown
 static GC gc;
-static XftDraw *xftdraw = NULL;
+static int have_thumbs = 0;  // overlay_thumbnails and the server supports them
+static int damage_event_base = 0;
+static XRenderPictFormat *rootfmt = NULL;
+static int have_sync = 0;  // The server has the SYNC extension
+static int sync_event_base = 0;
+static uint64_t sync_deadline = 0;  // Earliest syncdeadline of any client (ns), 0 if none
 static XftFont *font = NULL;
+static int font_loaded = 0;  // Set once the overlay font has been opened
+static unsigned long stackseq = 0;  // Last Client.stackseq handed out
 static XftColor xft_col_background, xft_col_foreground, xft_col_selection;
-static unsigned long border_normal, border_focused;
+static unsigned long border_normal, border_focused, border_marked;
+static int nmarked = 0;  // Number of marked clients
+
+// Key dispatch tables, rebuilt by grabkeys()
+static const Key *keytable[256][MODSLOTS];  // [keycode][modslot] -> binding
+static unsigned char modslot[256];          // CLEANMASK(state) -> slot, 0xff if unused
+static char keychar[256];                   // keycode -> grid char, 0 if none
+static signed char gridcell[256];           // grid char -> r * GRID_COLS + c, -1 if none
 
 // Multi-monitor support
 static Monitor *monitors = NULL;
 static Monitor *current_monitor = NULL;
 static int monitor_count = 0;
+static int rr_event_base = 0;
+static uint64_t screen_deadline = 0;  // Settled RandR changes are applied here (ns), 0 if none
+
+// Event recording (-r) and replay (-p)
+static FILE *recfile = NULL;
+static int replaying = 0;
+static volatile sig_atomic_t quit_pending = 0;  // SIGTERM, handled in the main loop
 
 // ICCCM atoms
-static Atom wm_protocols, wm_delete_window, wm_state, wm_take_focus;
+static Atom wm_protocols, wm_delete_window, wm_state, wm_take_focus, wm_window_role;
+
+// EWMH atoms
+static Atom net_wm_state, net_wm_state_hidden, net_wm_state_fullscreen;
+static Atom net_wm_window_type;
+static Atom net_wm_sync_request, net_wm_sync_request_counter;
+static Atom net_wm_bypass_compositor;
+static Atom net_wm_pid;
 
 // Forward decls
 static void arrange(void);
@@ -86,15 +202,28 @@ static void toggle_fullscreen(const Arg *arg);
 static void enter_overlay(const Arg *arg);
 static void process_overlay_input(void);
 static void draw_overlay(void);
+static void drawthumb(Monitor *mon, Client *c);
+static int hasthumb(Monitor *mon, Client *c);
 static void hide_overlay(void);
 static void quit(const Arg *arg);
 static void cycle_focus(const Arg *arg);
 static void cycle_focus_backward(const Arg *arg);
+static void focusdir(const Arg *arg);
+static void swapdir(const Arg *arg);
 static void grabkeys(void);
 static void setfullscreen(Client *c, int fullscreen);
+static Client *fullscreenon(Monitor *m);
+static int matchrule(Window win);
+static void updateprotocols(Client *c);
+static void manage(Window win, Visual *visual);
+static int holdwarm(Window win, XWindowAttributes *wa);
+static int iswarm(Window win);
+static void releasewarm(Window win);
+static void synctimeout(void);
 static int sendevent(Client *c, Atom proto);
 static void updateborder(Client *c);
 static void find_next_free_cell(Monitor *mon, int *out_r, int *out_c);
+static void find_free_span(Monitor *mon, int rows, int cols, int *r1, int *c1, int *r2, int *c2);
 static void switchws(const Arg *arg);
 static void movewin_to_ws(const Arg *arg);
 static void die(const char *fmt, ...);
@@ -104,81 +233,618 @@ static void update_monitors(void);
 static Monitor* get_monitor_at(int x, int y);
 static Monitor* get_monitor_for_window(Client *c);
 static void screenchange(XEvent *e);
+static void selmon(Monitor *m);
+static void togglemark(const Arg *arg);
+static void clearmarks(const Arg *arg);
+static Client **gettargets(int *n);
+static void updatevisibility(Client *c);
+static void endbatch(void);
+static void restack(Monitor *mon);
+static void setclientws(Client *c, int ws);
+static void create_overlay(Monitor *mon);
+static void load_font(void);
+static uint64_t now_ns(void);
+static void free_monitor(Monitor *mon);
+static int cell_of(char ch, int *r, int *c);
+static void chordkey(char ch);
+static void cell_at(Monitor *mon, int x, int y, int *r, int *c);
+static void cell_geometry(Monitor *mon, int r1, int c1, int r2, int c2, int *x, int *y, int *w, int *h);
+static void movemouse(const Arg *arg);
+static void resizemouse(const Arg *arg);
+static void handleevent(XEvent *ev);
+static void savelayout(const Arg *arg);
+static void restorelayout(const Arg *arg);
 
 #include "config.h"
 
+#if GRID_ROWS > GRID_MAX || GRID_COLS > GRID_MAX
+#error "GRID_ROWS and GRID_COLS must not exceed GRID_MAX"
+#endif
+
+// Window rules, compiled at startup: rules with a class are chained by
+// class hash, the others on a wildcard chain, both in rules[] order. The
+// role and type properties are only read when some rule looks at them.
+#define RULEBUCKETS 64  // Power of two
+
+typedef struct {
+	unsigned int hclass, hinst, hrole;
+	Atom type;
+	int r1, c1, r2, c2;  // Cell span, r1 < 0 for the usual placement
+} CompiledRule;
+
+enum { RuleRole = 1, RuleType = 2 };
+
+static CompiledRule crules[LENGTH(rules)];
+static int rulebucket[RULEBUCKETS];  // First rule per class hash, -1 if none
+static int rulewild = -1;            // First rule without a class
+static int rulenext[LENGTH(rules)];  // Next rule on the same chain, -1 at the end
+static int rules_need = 0;           // RuleRole | RuleType
+
+// X request accounting per event handler and keys[] action
+typedef struct {
+	unsigned long calls, requests, roundtrips, max_roundtrips;
+} XStats;
+
+static XStats evstats[LASTEvent + 1];  // by event type, RandR in the last slot
+static XStats keystats[LENGTH(keys)];
+static unsigned long roundtrips = 0;   // counted by countroundtrip()
+static unsigned long last_processed = 0;
+static volatile sig_atomic_t dumpstats_pending = 0;
+
+// Round-trip budgets per event type, enforced by replay (-p)
+static const struct { int type; unsigned long roundtrips; } budgets[] = {
+	// attributes, WM_CLASS for rules, WM_PROTOCOLS, sync counter, and
+	// _NET_WM_PID while a warm pool waits for a window; rules on role or
+	// type add one round trip each (WM_WINDOW_ROLE, _NET_WM_WINDOW_TYPE)
+	{ MapRequest,    5 },
+	{ EnterNotify,   0 },
+	{ ButtonPress,   2 },  // pointer query and grab for drags
+	{ PropertyNotify, 2 },  // WM_PROTOCOLS and sync counter when they change
+	{ UnmapNotify,   1 },
+	{ DestroyNotify, 1 },
+	{ ClientMessage, 1 },
+	{ ConfigureRequest, 0 },
+	{ Expose,        0 },
+};
+
+// Round-trip budgets per keys[] action
+static const struct { void (*func)(const Arg *); unsigned long roundtrips; } actionbudgets[] = {
+	{ spawn,                3 },  // a warm window is managed: WM_CLASS, WM_PROTOCOLS, sync counter
+	{ killclient,           1 },  // XSync after XKillClient
+	{ toggle_fullscreen,    0 },
+	{ enter_overlay,        0 },  // the font is loaded at first idle, not here
+	{ cycle_focus,          0 },
+	{ cycle_focus_backward, 0 },
+	{ focusdir,             0 },
+	{ swapdir,              0 },
+	{ switchws,             0 },
+	{ movewin_to_ws,        0 },
+	{ togglemark,           0 },
+	{ clearmarks,           0 },
+};
+
+// Xlib calls this after every request function. A round trip has happened
+// when the server has now processed everything we sent and that moved
+// forward during the call, i.e. we blocked on a reply or XSync.
+static int countroundtrip(Display *d) {
+	unsigned long done = LastKnownRequestProcessed(d);
+	if (done != last_processed && done == NextRequest(d) - 1)
+		roundtrips++;
+	last_processed = done;
+	return 0;
+}
+
+static void account_begin(unsigned long *req, unsigned long *rt) {
+	// Events read since the last request may have moved this on
+	last_processed = LastKnownRequestProcessed(dpy);
+	*req = NextRequest(dpy);
+	*rt = roundtrips;
+}
+
+static void account_end(XStats *st, unsigned long req, unsigned long rt) {
+	unsigned long n = roundtrips - rt;
+	st->calls++;
+	st->requests += NextRequest(dpy) - req;
+	st->roundtrips += n;
+	if (n > st->max_roundtrips)
+		st->max_roundtrips = n;
+}
+
+static const char *eventname(int type);
+
+static void keyname(unsigned int i, char *buf, size_t size) {
+	const char *ks = XKeysymToString(keys[i].keysym);
+	snprintf(buf, size, "key 0x%x+%s", keys[i].mod, ks ? ks : "?");
+}
+
+static void dumpstats(FILE *f) {
+	fprintf(f, "%-24s %8s %10s %8s %8s %8s\n", "handler", "calls", "requests", "req/call", "rtt", "rtt max");
+	for (int i = 0; i <= LASTEvent; i++) {
+		XStats *st = &evstats[i];
+		if (!st->calls) continue;
+		fprintf(f, "%-24s %8lu %10lu %8.1f %8lu %8lu\n",
+				i == LASTEvent ? "RRScreenChangeNotify" : eventname(i),
+				st->calls, st->requests, (double)st->requests / st->calls,
+				st->roundtrips, st->max_roundtrips);
+	}
+	for (unsigned int i = 0; i < LENGTH(keys); i++) {
+		XStats *st = &keystats[i];
+		char name[64];
+		if (!st->calls) continue;
+		keyname(i, name, sizeof(name));
+		fprintf(f, "%-24s %8lu %10lu %8.1f %8lu %8lu\n", name,
+				st->calls, st->requests, (double)st->requests / st->calls,
+				st->roundtrips, st->max_roundtrips);
+	}
+	fflush(f);
+}
+
+// Report handlers whose worst case exceeded their round-trip budget
+static int checkbudgets(FILE *f) {
+	int over = 0;
+	for (unsigned int i = 0; i < LENGTH(budgets); i++) {
+		XStats *st = &evstats[budgets[i].type];
+		if (st->max_roundtrips > budgets[i].roundtrips) {
+			fprintf(f, "gbwm: %s over budget: %lu round trips, budget %lu\n",
+					eventname(budgets[i].type), st->max_roundtrips, budgets[i].roundtrips);
+			over = 1;
+		}
+	}
+	for (unsigned int i = 0; i < LENGTH(keys); i++) {
+		for (unsigned int j = 0; j < LENGTH(actionbudgets); j++) {
+			if (keys[i].func != actionbudgets[j].func ||
+				keystats[i].max_roundtrips <= actionbudgets[j].roundtrips)
+				continue;
+			char name[64];
+			keyname(i, name, sizeof(name));
+			fprintf(f, "gbwm: %s over budget: %lu round trips, budget %lu\n",
+					name, keystats[i].max_roundtrips, actionbudgets[j].roundtrips);
+			over = 1;
+		}
+	}
+	return over;
+}
+
+static void sigusr1(int s) {
+	(void)s;
+	dumpstats_pending = 1;
+}
+
+static void sigterm(int s) {
+	(void)s;
+	quit_pending = 1;
+}
+
+// Packed copies of client and monitor rectangles (struct of arrays) for
+// the hit tests. Corners are stored as [x0, x1) x [y0, y1).
+typedef struct {
+	int *x0, *y0, *x1, *y1, *flags;
+	int n, cap;
+} RectSet;
+
+enum { RectFullscreen = 1 };
+
+static RectSet wsrects[9];      // Clients per workspace
+static int wsrects_valid[9];    // Cleared by invalidate() on any change
+static unsigned int wsgen[9] = { 1, 1, 1, 1, 1, 1, 1, 1, 1 };  // Bumped by invalidate()
+static RectSet monrects;        // Monitors, in list order
+static Monitor **monindex = NULL;
+
+#if defined(__AVX2__)
+typedef __m256i vint;
+#define VLANES 8
+#define vset1(a) _mm256_set1_epi32(a)
+#define vload(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vand(a, b) _mm256_and_si256(a, b)
+#define vandnot(a, b) _mm256_andnot_si256(a, b)
+#define vgt(a, b) _mm256_cmpgt_epi32(a, b)
+#define veq(a, b) _mm256_cmpeq_epi32(a, b)
+#define vany(a) _mm256_movemask_epi8(a)
+#elif defined(__SSE2__)
+typedef __m128i vint;
+#define VLANES 4
+#define vset1(a) _mm_set1_epi32(a)
+#define vload(p) _mm_loadu_si128((const __m128i *)(p))
+#define vand(a, b) _mm_and_si128(a, b)
+#define vandnot(a, b) _mm_andnot_si128(a, b)
+#define vgt(a, b) _mm_cmpgt_epi32(a, b)
+#define veq(a, b) _mm_cmpeq_epi32(a, b)
+#define vany(a) _mm_movemask_epi8(a)
+#endif
+
+static void rects_push(RectSet *s, int x, int y, int w, int h, int flags) {
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 32;
+		s->x0 = realloc(s->x0, s->cap * sizeof(int));
+		s->y0 = realloc(s->y0, s->cap * sizeof(int));
+		s->x1 = realloc(s->x1, s->cap * sizeof(int));
+		s->y1 = realloc(s->y1, s->cap * sizeof(int));
+		s->flags = realloc(s->flags, s->cap * sizeof(int));
+	}
+	s->x0[s->n] = x;
+	s->y0[s->n] = y;
+	s->x1[s->n] = x + w;
+	s->y1[s->n] = y + h;
+	s->flags[s->n] = flags;
+	s->n++;
+}
+
+static void invalidate(int ws) {
+	wsrects_valid[ws] = 0;
+	wsgen[ws]++;
+}
+
+static RectSet *clientrects(int ws) {
+	RectSet *s = &wsrects[ws];
+	if (!wsrects_valid[ws]) {
+		s->n = 0;
+		for (Client *c = workspaces[ws]; c; c = c->next)
+			rects_push(s, c->x, c->y, c->w, c->h, c->isfullscreen ? RectFullscreen : 0);
+		wsrects_valid[ws] = 1;
+	}
+	return s;
+}
+
+// Does any rectangle without a skip flag overlap [x0, x1) x [y0, y1)?
+static int rects_overlap(const RectSet *s, int x0, int y0, int x1, int y1, int skip) {
+	int i = 0;
+#ifdef VLANES
+	vint vx0 = vset1(x0), vy0 = vset1(y0), vx1 = vset1(x1), vy1 = vset1(y1);
+	vint vskip = vset1(skip), zero = vset1(0);
+	for (; i + VLANES <= s->n; i += VLANES) {
+		vint hit = vand(vand(vgt(vload(s->x1 + i), vx0), vgt(vx1, vload(s->x0 + i))),
+						vand(vgt(vload(s->y1 + i), vy0), vgt(vy1, vload(s->y0 + i))));
+		hit = vand(hit, veq(vand(vload(s->flags + i), vskip), zero));
+		if (vany(hit))
+			return 1;
+	}
+#endif
+	for (; i < s->n; i++)
+		if (!(s->flags[i] & skip) && s->x1[i] > x0 && x1 > s->x0[i] &&
+			s->y1[i] > y0 && y1 > s->y0[i])
+			return 1;
+	return 0;
+}
+
+// Is there a rectangle without a skip flag exactly equal to the given one?
+static int rects_match(const RectSet *s, int x, int y, int w, int h, int skip) {
+	int i = 0;
+#ifdef VLANES
+	vint vx0 = vset1(x), vy0 = vset1(y), vx1 = vset1(x + w), vy1 = vset1(y + h);
+	vint vskip = vset1(skip), zero = vset1(0);
+	for (; i + VLANES <= s->n; i += VLANES) {
+		vint hit = vand(vand(veq(vload(s->x0 + i), vx0), veq(vload(s->y0 + i), vy0)),
+						vand(veq(vload(s->x1 + i), vx1), veq(vload(s->y1 + i), vy1)));
+		hit = vand(hit, veq(vand(vload(s->flags + i), vskip), zero));
+		if (vany(hit))
+			return 1;
+	}
+#endif
+	for (; i < s->n; i++)
+		if (!(s->flags[i] & skip) && s->x0[i] == x && s->y0[i] == y &&
+			s->x1[i] == x + w && s->y1[i] == y + h)
+			return 1;
+	return 0;
+}
+
+// Index of the first rectangle containing (x, y), or -1
+static int rects_find_point(const RectSet *s, int x, int y) {
+	int i = 0;
+#ifdef VLANES
+	vint vx = vset1(x), vy = vset1(y);
+	for (; i + VLANES <= s->n; i += VLANES) {
+		// x0 <= x < x1 and y0 <= y < y1
+		vint hit = vand(vandnot(vgt(vload(s->x0 + i), vx), vgt(vload(s->x1 + i), vx)),
+						vandnot(vgt(vload(s->y0 + i), vy), vgt(vload(s->y1 + i), vy)));
+		if (vany(hit))
+			break;  // the scalar loop finds the lane
+	}
+#endif
+	for (; i < s->n; i++)
+		if (x >= s->x0[i] && x < s->x1[i] && y >= s->y0[i] && y < s->y1[i])
+			return i;
+	return -1;
+}
+
 // Event handlers
+static Client *wintoclient(Window w) {
+	for (int i = 0; i < 9; i++)
+		for (Client *c = workspaces[i]; c; c = c->next)
+			if (c->win == w)
+				return c;
+	return NULL;
+}
+
+// First visible client on mon, in list order
+static Client *firstvisible(Monitor *mon) {
+	for (Client *c = workspaces[mon->ws]; c; c = c->next)
+		if (c->mapped && get_monitor_for_window(c) == mon)
+			return c;
+	return NULL;
+}
+
+// Publish WM_STATE and _NET_WM_STATE for a client's visibility
+static void setclientstate(Client *c) {
+	long data[] = { c->mapped ? NormalState : IconicState, None };
+	Atom states[2];
+	int n = 0;
+
+	XChangeProperty(dpy, c->win, wm_state, wm_state, 32, PropModeReplace, (unsigned char *)data, 2);
+	if (c->isfullscreen) states[n++] = net_wm_state_fullscreen;
+	if (!c->mapped) states[n++] = net_wm_state_hidden;
+	XChangeProperty(dpy, c->win, net_wm_state, XA_ATOM, 32, PropModeReplace, (unsigned char *)states, n);
+}
+
+// X position of a parked window: just left of the root window
+static int parkx(Client *c) {
+	return -(c->w + 2 * (int)border_width) - 1;
+}
+
+// Hide a client of an inactive workspace. With park_hidden the window stays
+// mapped and is moved off-screen, so clients keep their rendering surfaces.
+static void hideclient(Client *c) {
+	if (!c->mapped) return;
+	c->mapped = 0;
+	if (park_hidden) {
+		XMoveWindow(dpy, c->win, parkx(c), c->y);
+	} else {
+		c->ignore_unmap++;
+		XUnmapWindow(dpy, c->win);
+	}
+	setclientstate(c);
+}
+
+static void showclient(Client *c) {
+	if (c->mapped) return;
+	c->mapped = 1;
+	if (park_hidden)
+		XMoveWindow(dpy, c->win, c->x, c->y);
+	else
+		XMapWindow(dpy, c->win);
+	setclientstate(c);
+}
+
 static void buttonpress(XEvent *e) {
-	for (Client *c = workspaces[current_ws]; c; c = c->next)
-		if (c->win == e->xbutton.subwindow) {
-			focus(c, 1);
-			break;
+	Client *c = wintoclient(e->xbutton.subwindow);
+	if (!c || !c->mapped) return;
+
+	unsigned int state = CLEANMASK(e->xbutton.state);
+	for (unsigned int i = 0; i < sizeof(buttons) / sizeof(Button); i++) {
+		if (buttons[i].button == e->xbutton.button && CLEANMASK(buttons[i].mask) == state) {
+			focus(c, 0);
+			buttons[i].func(&buttons[i].arg);
+			return;
 		}
+	}
+	focus(c, 1);
 }
 
 static void clientmessage(XEvent *e) {
 	XClientMessageEvent *cme = &e->xclient;
-	Client *c;
-	for (c = workspaces[current_ws]; c; c = c->next)
-		if (c->win == cme->window)
-			break;
+	Client *c = wintoclient(cme->window);
 	if (!c)
 		return;
 
-	if (cme->message_type == wm_state && cme->data.l[1] == (long)XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False)) {
+	if (cme->message_type == net_wm_state && (cme->data.l[1] == (long)net_wm_state_fullscreen ||
+											 cme->data.l[2] == (long)net_wm_state_fullscreen)) {
 		setfullscreen(c, cme->data.l[0] == 1 || (cme->data.l[0] == 2 && !c->isfullscreen));
 	}
 }
 
+// ConfigureRequests are answered once the event queue is drained, one
+// answer per window, so a client resizing in a loop costs one reply per
+// batch. Unmanaged windows get the union of their requests; managed ones
+// a synthetic ConfigureNotify with the geometry gbwm gave them.
+#define PENDINGCFG 64
+
+static struct {
+	Window win;
+	int managed;
+	unsigned int mask;
+	XWindowChanges wc;
+} pendingcfg[PENDINGCFG];
+static int npendingcfg = 0;
+
+static void sendconfigure(Client *c) {
+	XConfigureEvent ce = {0};
+
+	ce.type = ConfigureNotify;
+	ce.display = dpy;
+	ce.event = c->win;
+	ce.window = c->win;
+	ce.x = c->mapped || !park_hidden ? c->x : parkx(c);
+	ce.y = c->y;
+	ce.width = c->w;
+	ce.height = c->h;
+	ce.border_width = c->isfullscreen ? 0 : border_width;
+	ce.above = None;
+	ce.override_redirect = False;
+	XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+}
+
+static void flushconfigs(void) {
+	unsigned long req, rt;
+
+	account_begin(&req, &rt);
+	for (int i = 0; i < npendingcfg; i++) {
+		Client *c = wintoclient(pendingcfg[i].win);
+		if (c)
+			sendconfigure(c);
+		else if (!pendingcfg[i].managed) {
+			// A warm window parked off-screen stays there
+			if (park_hidden && iswarm(pendingcfg[i].win))
+				pendingcfg[i].mask &= ~(CWX | CWY);
+			XConfigureWindow(dpy, pendingcfg[i].win, pendingcfg[i].mask, &pendingcfg[i].wc);
+		}
+		// else: destroyed since the request
+	}
+	npendingcfg = 0;
+	// Charged to ConfigureRequest, without counting as a call
+	evstats[ConfigureRequest].requests += NextRequest(dpy) - req;
+	evstats[ConfigureRequest].roundtrips += roundtrips - rt;
+}
+
+static void configurerequest(XEvent *e) {
+	XConfigureRequestEvent *ev = &e->xconfigurerequest;
+	int i;
+
+	for (i = 0; i < npendingcfg && pendingcfg[i].win != ev->window; i++)
+		;
+	if (i == PENDINGCFG) {
+		flushconfigs();
+		i = 0;
+	}
+	if (i == npendingcfg) {
+		npendingcfg++;
+		pendingcfg[i].win = ev->window;
+		pendingcfg[i].managed = wintoclient(ev->window) != NULL;
+		pendingcfg[i].mask = 0;
+	}
+
+	// Later values win; unset fields keep what earlier requests asked for
+	XWindowChanges *wc = &pendingcfg[i].wc;
+	if (ev->value_mask & CWX) wc->x = ev->x;
+	if (ev->value_mask & CWY) wc->y = ev->y;
+	if (ev->value_mask & CWWidth) wc->width = ev->width;
+	if (ev->value_mask & CWHeight) wc->height = ev->height;
+	if (ev->value_mask & CWBorderWidth) wc->border_width = ev->border_width;
+	if (ev->value_mask & CWSibling) wc->sibling = ev->above;
+	if (ev->value_mask & CWStackMode) wc->stack_mode = ev->detail;
+	pendingcfg[i].mask |= ev->value_mask;
+}
+
 static void maprequest(XEvent *e) {
 	XWindowAttributes wa;
 	if (!XGetWindowAttributes(dpy, e->xmaprequest.window, &wa)) return;
 	if (wa.override_redirect) return;
 
+	// A warm pool instance stays hidden until its key asks for it
+	if (!holdwarm(e->xmaprequest.window, &wa))
+		manage(e->xmaprequest.window, wa.visual);
+}
+
+static void manage(Window win, Visual *visual) {
 	Client *c = calloc(1, sizeof(Client));
-	c->win = e->xmaprequest.window;
-	c->workspace = current_ws;
-	c->next = workspaces[current_ws];
-	workspaces[current_ws] = c;
+	c->win = win;
+	c->stackseq = ++stackseq;  // New windows start on top of their layer
+	if (have_thumbs) {
+		c->format = XRenderFindVisualFormat(dpy, visual);
+		c->damage = XDamageCreate(dpy, c->win, XDamageReportNonEmpty);
+		c->thumbdirty = 1;
+	}
+
+	// Workspace, monitor and cell span are decided before the first map, so
+	// the window is configured once and never shows up in the wrong place
+	int i = matchrule(c->win);
+	const Rule *rule = i >= 0 ? &rules[i] : NULL;
+	Monitor *mon = current_monitor ? current_monitor : monitors;
+	if (rule && rule->monitor >= 0)
+		for (Monitor *m = monitors; m; m = m->next)
+			if (m->num == rule->monitor)
+				mon = m;
+	int ws = mon->ws;
+	if (rule && rule->ws >= 0 && rule->ws < 9) {
+		ws = rule->ws;
+		// Without a monitor of its own, go where ws is shown
+		if (rule->monitor < 0)
+			for (Monitor *m = monitors; m; m = m->next)
+				if (m->ws == ws)
+					mon = m;
+	}
+
+	int r1, c1, r2, c2, x, y, w, h;
+	if (rule && crules[i].r1 >= 0) {
+		r1 = crules[i].r1; c1 = crules[i].c1;
+		r2 = crules[i].r2; c2 = crules[i].c2;
+	} else {
+		// Free space on ws, which mon need not be showing
+		int shown = mon->ws;
+		mon->ws = ws;
+		find_free_span(mon, 0, 0, &r1, &c1, &r2, &c2);
+		mon->ws = shown;
+	}
+	cell_geometry(mon, r1, c1, r2, c2, &x, &y, &w, &h);
+
+	c->workspace = ws;
+	invalidate(ws);
+	c->next = workspaces[ws];
+	workspaces[ws] = c;
+	c->mapped = mon->ws == ws;
 
 	// ICCCM setup
 	XSetWindowBorderWidth(dpy, c->win, border_width);
 	XSelectInput(dpy, c->win, EnterWindowMask | FocusChangeMask | PropertyChangeMask | StructureNotifyMask);
 
-	// Set WM_STATE
-	long data[] = { NormalState, None };
-	XChangeProperty(dpy, c->win, wm_state, wm_state, 32, PropModeReplace, (unsigned char *)data, 2);
+	resize(c, x, y, w, h);
+	if (rule && rule->fullscreen)
+		setfullscreen(c, 1);
+	setclientstate(c);
+	// After the initial geometry, which needs no sync request
+	updateprotocols(c);
 
-	XMapWindow(dpy, c->win);
-	c->mapped = 1;
-	focus(c, 0);
-	arrange();
-	focus(c, 1);
+	// A window for a hidden workspace is only mapped when parked
+	if (c->mapped || park_hidden)
+		XMapWindow(dpy, c->win);
+	if (c->mapped)
+		focus(c, 1);
 }
 
 static void removeclient(Window win) {
-	Client *c, **prev;
-	for (prev = &workspaces[current_ws]; (c = *prev); prev = &c->next) {
-		if (c->win == win) {
-			*prev = c->next;
-			c->mapped = 0;
-			if (focused == c) {
-				focused = workspaces[current_ws];
-				if (focused)
-					focus(focused, 1);
-			}
-			free(c);
-			arrange();
-			return;
-		}
+	Client *c = wintoclient(win), **prev;
+	if (!c) return;
+
+	for (prev = &workspaces[c->workspace]; *prev != c; prev = &(*prev)->next)
+		;
+	*prev = c->next;
+	c->mapped = 0;
+	invalidate(c->workspace);
+	if (last_focused[c->workspace] == c)
+		last_focused[c->workspace] = NULL;
+	if (c->marked)
+		nmarked--;
+	if (c->syncalarm)
+		XSyncDestroyAlarm(dpy, c->syncalarm);
+	// Fails harmlessly when the window is already destroyed
+	if (c->damage)
+		XDamageDestroy(dpy, c->damage);
+	if (c->thumb)
+		XFreePixmap(dpy, c->thumb);
+	if (focused == c) {
+		focused = current_monitor ? firstvisible(current_monitor) : NULL;
+		if (focused)
+			focus(focused, 1);
 	}
+	free(c);
+	arrange();
 }
 
 static void unmapnotify(XEvent *e) {
-	removeclient(e->xunmap.window);
+	Client *c = wintoclient(e->xunmap.window);
+	if (!c) {
+		// A parked warm window was withdrawn by its application
+		if (e->xunmap.event == root || e->xunmap.send_event)
+			releasewarm(e->xunmap.window);
+		return;
+	}
+
+	// Every unmap is reported on the client and on root; count the root one
+	// only. A synthetic unmap is an ICCCM withdraw and always unmanages.
+	if (e->xunmap.send_event) {
+		removeclient(c->win);
+		return;
+	}
+	if (e->xunmap.event != root)
+		return;
+	// Ignore the unmaps we caused by hiding a workspace
+	if (c->ignore_unmap) {
+		c->ignore_unmap--;
+		return;
+	}
+	removeclient(c->win);
 }
 
 static void destroynotify(XEvent *e) {
+	releasewarm(e->xdestroywindow.window);
 	removeclient(e->xdestroywindow.window);
 }
 
@@ -190,48 +856,65 @@ static void enternotify(XEvent *e) {
 	if (e->xcrossing.mode == NotifyGrab || e->xcrossing.mode == NotifyUngrab)
 		return;
 	
-	for (Client *c = workspaces[current_ws]; c; c = c->next)
-		if (c->win == e->xcrossing.window && c->mapped) {
-			focus(c, 0);
-			break;
-		}
+	Client *c = wintoclient(e->xcrossing.window);
+	if (!c || !c->mapped)
+		return;
+	// Hover never takes focus away from a fullscreen window
+	Client *fs = fullscreenon(get_monitor_for_window(c));
+	if (!fs || fs == c)
+		focus(c, 0);
+}
+
+// A window with a thumbnail changed. ReportNonEmpty sends nothing more
+// until updatethumb() subtracts the damage, so a window that keeps
+// repainting while the overlay is hidden costs one event.
+static void damagenotify(XEvent *e) {
+	XDamageNotifyEvent *ev = (XDamageNotifyEvent *)e;
+	Client *c = wintoclient(ev->drawable);
+
+	if (!c) return;
+	c->thumbdirty = 1;
+	// Only this thumbnail is redrawn; clearing the overlay would flicker
+	if (overlay_mode && overlay_mon && hasthumb(overlay_mon, c)) {
+		drawthumb(overlay_mon, c);
+		XFlush(dpy);
+	}
+}
+
+static void propertynotify(XEvent *e) {
+	XPropertyEvent *ev = &e->xproperty;
+	Client *c;
+
+	if (ev->atom == wm_protocols && (c = wintoclient(ev->window)))
+		updateprotocols(c);
 }
 
 static void expose(XEvent *e) {
-	if (e->xexpose.window == overlay_win && overlay_mode) {
+	if (overlay_mode && overlay_mon && e->xexpose.window == overlay_mon->overlay) {
 		draw_overlay();
 	}
 }
 
 static void keypress(XEvent *e) {
+	unsigned int code = e->xkey.keycode & 0xff;
+
 	if (overlay_mode) {
-		KeySym k = XLookupKeysym(&e->xkey, 0);
-		if (k == XK_Escape) {
-			hide_overlay();
-			return;
-		}
-		if (k == XK_BackSpace) {
-			if (overlay_input[1] != 0) {
-				overlay_input[1] = 0;
-			} else if (overlay_input[0] != 0) {
-				overlay_input[0] = 0;
+		char ch = keychar[code];
+		if (!ch) {
+			KeySym k = XLookupKeysym(&e->xkey, 0);
+			if (k == XK_Escape) {
+				hide_overlay();
+			} else if (k == XK_BackSpace) {
+				if (overlay_input[1] != 0) {
+					overlay_input[1] = 0;
+				} else if (overlay_input[0] != 0) {
+					overlay_input[0] = 0;
+				}
+				draw_overlay();
 			}
-			draw_overlay();
 			return;
 		}
 
-		char ch = 0;
-		if (k >= '0' && k <= '9') ch = (char)k;
-		else if (k >= 'a' && k <= 'z') ch = (char)k;
-		else if (k >= 'A' && k <= 'Z') ch = (char)(k - 'A' + 'a');
-		else return;
-
-		int found = 0;
-		for (int r = 0; r < GRID_ROWS && !found; r++)
-			for (int c = 0; c < GRID_COLS && !found; c++)
-				if (grid_chars[r][c] == ch) found = 1;
-		if (!found) return;
-
 		if (overlay_input[0] == 0) {
 			overlay_input[0] = ch;
 			draw_overlay();
@@ -249,41 +932,182 @@ static void keypress(XEvent *e) {
 		return;
 	}
 
-	KeySym keysym = XLookupKeysym(&e->xkey, 0);
-	unsigned int state = e->xkey.state & ~(LockMask | Mod2Mask);
+	// Grid keys typed with place_mod held place the focused window directly
+	unsigned int state = CLEANMASK(e->xkey.state);
+	if (state == CLEANMASK(place_mod) && keychar[code]) {
+		if (focused)
+			chordkey(keychar[code]);
+		return;
+	}
 
-	for (unsigned int i = 0; i < sizeof(keys) / sizeof(Key); i++) {
-		if (keysym == keys[i].keysym && state == keys[i].mod && keys[i].func) {
-			keys[i].func(&keys[i].arg);
-			return;
-		}
+	unsigned char slot = modslot[state];
+	if (slot >= MODSLOTS) return;
+
+	const Key *k = keytable[code][slot];
+	if (k) {
+		unsigned long req, rt;
+		account_begin(&req, &rt);
+		k->func(&k->arg);
+		account_end(&keystats[k - keys], req, rt);
+	}
+}
+
+// Placement chords reuse overlay_input and process_overlay_input() but never
+// map or draw the overlay, unless the chord times out half way.
+static void chordkey(char ch) {
+	if (!overlay_input[0]) {
+		overlay_input[0] = ch;
+		chord_deadline = now_ns() + chord_timeout_ms * 1000000ull;
+		return;
+	}
+
+	overlay_input[1] = ch;
+	chord_deadline = 0;
+	process_overlay_input();
+	memset(overlay_input, 0, sizeof(overlay_input));
+}
+
+// The chord was not finished in time: show the overlay with the first key
+static void chordtimeout(void) {
+	char first = overlay_input[0];
+
+	chord_deadline = 0;
+	enter_overlay(NULL);
+	if (overlay_mode) {
+		overlay_input[0] = first;
+		draw_overlay();
+	} else {
+		memset(overlay_input, 0, sizeof(overlay_input));
 	}
 }
 
+static void mappingnotify(XEvent *e) {
+	XMappingEvent *ev = &e->xmapping;
+
+	XRefreshKeyboardMapping(ev);
+	if (ev->request == MappingKeyboard || ev->request == MappingModifier)
+		grabkeys();
+}
+
+// RandR changes come in bursts when a laptop is docked or undocked; they
+// are applied once no further change arrived for hotplug_settle_ms
 static void screenchange(XEvent *e) {
 	XRRUpdateConfiguration(e);
+	screen_deadline = now_ns() + hotplug_settle_ms * 1000000ull;
+}
+
+// Nearest head to the rectangle of a head that went away
+static Monitor *nearest_monitor(int x, int y, int w, int h) {
+	Monitor *best = monitors;
+	long bestd = -1;
+
+	for (Monitor *m = monitors; m; m = m->next) {
+		long dx = (m->x + m->w / 2) - (x + w / 2);
+		long dy = (m->y + m->h / 2) - (y + h / 2);
+		if (bestd < 0 || dx * dx + dy * dy < bestd) {
+			best = m;
+			bestd = dx * dx + dy * dy;
+		}
+	}
+	return best;
+}
+
+// Apply the settled RandR configuration. Windows keep their cell span:
+// on a head that went away they move to the same span on the nearest
+// remaining head, and they go back when a head shows up at the old place.
+static void monitorschanged(void) {
+	unsigned long req, rt;
+	Monitor *m;
+	Client *c;
+	int x, y, w, h;
+
+	account_begin(&req, &rt);
+	screen_deadline = 0;
 	sw = DisplayWidth(dpy, screen);
 	sh = DisplayHeight(dpy, screen);
+
+	// Where each window sits on the heads as they were
+	for (int ws = 0; ws < 9; ws++)
+		for (c = workspaces[ws]; c; c = c->next) {
+			if (!c->w || c->displaced) continue;
+			x = c->isfullscreen ? c->saved_x : c->x;
+			y = c->isfullscreen ? c->saved_y : c->y;
+			w = c->isfullscreen ? c->saved_w : c->w;
+			h = c->isfullscreen ? c->saved_h : c->h;
+			m = get_monitor_at(x + w / 2, y + h / 2);
+			c->home.x = m->x; c->home.y = m->y;
+			c->home.w = m->w; c->home.h = m->h;
+			cell_at(m, x, y, &c->home.r1, &c->home.c1);
+			cell_at(m, x + w - 1, y + h - 1, &c->home.r2, &c->home.c2);
+		}
+
 	update_monitors();
+
+	XGrabServer(dpy);
+	for (int ws = 0; ws < 9; ws++)
+		for (c = workspaces[ws]; c; c = c->next) {
+			if (!c->w) continue;
+			Monitor *to = NULL;
+			for (m = monitors; m; m = m->next)
+				if (m->x == c->home.x && m->y == c->home.y)
+					to = m;
+			if (to && !c->displaced && to->w == c->home.w && to->h == c->home.h)
+				continue;  // Head unchanged
+			c->displaced = !to;
+			if (!to)
+				to = nearest_monitor(c->home.x, c->home.y, c->home.w, c->home.h);
+
+			cell_geometry(to, c->home.r1, c->home.c1, c->home.r2, c->home.c2, &x, &y, &w, &h);
+			if (c->isfullscreen) {
+				c->saved_x = x; c->saved_y = y;
+				c->saved_w = w; c->saved_h = h;
+				resize(c, to->x, to->y, to->w, to->h);
+			} else {
+				resize(c, x, y, w, h);
+			}
+			updatevisibility(c);
+		}
+	XUngrabServer(dpy);
+
 	arrange();
+	for (m = monitors; m; m = m->next)
+		restack(m);
+	XFlush(dpy);
+	// Charged to RandR, without counting as a call
+	evstats[LASTEvent].requests += NextRequest(dpy) - req;
+	evstats[LASTEvent].roundtrips += roundtrips - rt;
 }
 
 // Monitor management
 static void update_monitors(void) {
+	struct { int x, y, ws; } old[32];
+	int nold = 0, selx = 0, sely = 0;
 	Monitor *m;
+
+	if (overlay_mode)
+		hide_overlay();
+	// Remember what each head showed so a surviving head keeps its workspace
+	for (m = monitors; m && nold < 32; m = m->next, nold++) {
+		old[nold].x = m->x;
+		old[nold].y = m->y;
+		old[nold].ws = m->ws;
+	}
+	if (current_monitor) {
+		selx = current_monitor->x;
+		sely = current_monitor->y;
+	}
 	while (monitors) {
 		m = monitors->next;
-		free(monitors);
+		free_monitor(monitors);
 		monitors = m;
 	}
 	monitors = NULL;
 	current_monitor = NULL;
 	monitor_count = 0;
 
+	// NULL without RandR; the single-monitor fallback below covers that
 	XRRScreenResources *sr = XRRGetScreenResources(dpy, root);
-	if (!sr) return;
-
-	for (int i = 0; i < sr->ncrtc; i++) {
+	for (int i = 0; sr && i < sr->ncrtc; i++) {
 		XRRCrtcInfo *ci = XRRGetCrtcInfo(dpy, sr, sr->crtcs[i]);
 		if (!ci || ci->noutput == 0 || ci->width == 0 || ci->height == 0) {
 			if (ci) XRRFreeCrtcInfo(ci);
@@ -296,12 +1120,16 @@ static void update_monitors(void) {
 		mon->y = ci->y;
 		mon->w = ci->width;
 		mon->h = ci->height;
+		for (int j = 0; j < nold; j++)
+			if (old[j].x == mon->x && old[j].y == mon->y)
+				mon->ws = old[j].ws;
 		mon->next = monitors;
 		monitors = mon;
 
 		XRRFreeCrtcInfo(ci);
 	}
-	XRRFreeScreenResources(sr);
+	if (sr)
+		XRRFreeScreenResources(sr);
 
 	if (!monitors) {
 		monitors = calloc(1, sizeof(Monitor));
@@ -310,17 +1138,68 @@ static void update_monitors(void) {
 		monitors->w = sw;
 		monitors->h = sh;
 		monitors->num = 0;
+		monitors->ws = current_ws;
 		monitor_count = 1;
 	}
-	current_monitor = monitors;
+	selmon(monitors);
+	for (m = monitors; m; m = m->next)
+		if (m->x == selx && m->y == sely)
+			selmon(m);
+
+	// Packed monitor rectangles for get_monitor_at()
+	monrects.n = 0;
+	for (m = monitors; m; m = m->next)
+		rects_push(&monrects, m->x, m->y, m->w, m->h, 0);
+	monindex = realloc(monindex, monitor_count * sizeof(Monitor *));
+	int i = 0;
+	for (m = monitors; m; m = m->next)
+		monindex[i++] = m;
+
+	// Until the font is loaded, load_font() creates the overlays
+	if (font_loaded)
+		for (m = monitors; m; m = m->next)
+			create_overlay(m);
 }
 
-static Monitor* get_monitor_at(int x, int y) {
-	for (Monitor *m = monitors; m; m = m->next) {
-		if (x >= m->x && x < m->x + m->w && y >= m->y && y < m->y + m->h)
-			return m;
+// Make m the current monitor; current_ws follows the monitor
+static void selmon(Monitor *m) {
+	current_monitor = m;
+	if (m)
+		current_ws = m->ws;
+}
+
+// Move a client to another workspace list
+static void setclientws(Client *c, int ws) {
+	Client **prev;
+	if (c->workspace == ws) return;
+
+	for (prev = &workspaces[c->workspace]; *prev; prev = &(*prev)->next) {
+		if (*prev == c) {
+			*prev = c->next;
+			break;
+		}
 	}
-	return monitors;
+	if (last_focused[c->workspace] == c)
+		last_focused[c->workspace] = NULL;
+	invalidate(c->workspace);
+	invalidate(ws);
+	c->workspace = ws;
+	c->next = workspaces[ws];
+	workspaces[ws] = c;
+}
+
+static void free_monitor(Monitor *mon) {
+	free(mon->stack);
+	if (mon->overlay_draw)
+		XftDrawDestroy(mon->overlay_draw);
+	if (mon->overlay)
+		XDestroyWindow(dpy, mon->overlay);
+	free(mon);
+}
+
+static Monitor* get_monitor_at(int x, int y) {
+	int i = rects_find_point(&monrects, x, y);
+	return i >= 0 ? monindex[i] : monitors;
 }
 
 static Monitor* get_monitor_for_window(Client *c) {
@@ -350,11 +1229,11 @@ static void focus_monitor(const Arg *arg) {
 	}
 	
 	if (!target) target = monitors;
-	current_monitor = target;
+	selmon(target);
 	
 	Client *to_focus = NULL;
 	for (Client *c = workspaces[current_ws]; c; c = c->next) {
-		if (c->isfullscreen) continue;
+		if (c->isfullscreen || !c->mapped) continue;
 		
 		Monitor *win_mon = get_monitor_for_window(c);
 		if (win_mon == target) {
@@ -374,10 +1253,10 @@ static void focus_monitor(const Arg *arg) {
 }
 
 static void movewin_to_monitor(const Arg *arg) {
-	if (!focused || !monitors || monitor_count <= 1) return;
+	if (!monitors || monitor_count <= 1) return;
 	
 	int direction = arg->i;
-	Monitor *current = get_monitor_for_window(focused);
+	Monitor *current = focused ? get_monitor_for_window(focused) : current_monitor;
 	Monitor *target = NULL;
 	
 	if (direction > 0) {
@@ -397,50 +1276,383 @@ static void movewin_to_monitor(const Arg *arg) {
 	
 	if (!target || target == current) return;
 	
-	// Find a free cell on the target monitor
-	int r, c;
-	find_next_free_cell(target, &r, &c);
-	
-	int cell_w = (target->w - padding * (GRID_COLS + 1)) / GRID_COLS;
-	int cell_h = (target->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
-	
-	int x = target->x + padding + c * (cell_w + padding);
-	int y = target->y + padding + r * (cell_h + padding);
-	
-	resize(focused, x, y, cell_w, cell_h);
+	int n;
+	Client **t = gettargets(&n);
+	if (!n) return;
+	for (int i = 0; i < n; i++) {
+		Client *c = t[i];
+		Monitor *from = get_monitor_for_window(c);
+		if (from == target) continue;
+
+		// Find free space on the target monitor, keeping the window's span if possible
+		int r1, c1, r2, c2, x, y, w, h;
+		cell_at(from, c->x, c->y, &r1, &c1);
+		cell_at(from, c->x + c->w - 1, c->y + c->h - 1, &r2, &c2);
+		find_free_span(target, r2 - r1 + 1, c2 - c1 + 1, &r1, &c1, &r2, &c2);
+		cell_geometry(target, r1, c1, r2, c2, &x, &y, &w, &h);
+		
+		resize(c, x, y, w, h);
+		setclientws(c, target->ws);
+		updatevisibility(c);
+	}
+	endbatch();
 	
 	arrange();
-	focus(focused, 1);
-}
-
-// Core logic
-static void resize(Client *c, int x, int y, int w, int h) {
-	c->x = x; c->y = y; c->w = w; c->h = h;
-	XMoveResizeWindow(dpy, c->win, x, y, w, h);
+	if (focused) focus(focused, 1);
 }
 
-static void updateborder(Client *c) {
-	XSetWindowBorder(dpy, c->win, c == focused ? border_focused : border_normal);
+// Events handled during a drag: the pointer, redraws, requests from
+// clients and sync alarms, so paced resizes keep going. MapRequest waits
+// in the queue until the drop: a new window would take focus and warp the
+// pointer away from the window being dragged.
+static Bool dragevent(Display *d, XEvent *ev, XPointer arg) {
+	switch (ev->type) {
+		case ButtonPress: case ButtonRelease: case MotionNotify:
+		case Expose: case GraphicsExpose: case NoExpose:
+		case ConfigureRequest: case CirculateRequest:
+			return True;
+	}
+	return have_sync && ev->type == sync_event_base + XSyncAlarmNotify;
 }
 
-static void focus(Client *c, int warp) {
-	if (!c) return;
+// Mouse move/resize. The window snaps to grid cells while dragging;
+// motion is compressed and rate limited to drag_refresh_hz, and the window
+// is only reconfigured when the snapped cell span changes.
+static void dragmouse(int resizing) {
+	Client *c = focused;
+	// Drag motion was recorded inside the grab; replay has no pointer to follow
+	if (!c || c->isfullscreen || replaying) return;
 
-	Client *old = focused;
-	focused = c;
+	Monitor *mon = get_monitor_for_window(c);
+	int r1, c1, r2, c2;
+	cell_at(mon, c->x, c->y, &r1, &c1);
+	cell_at(mon, c->x + c->w - 1, c->y + c->h - 1, &r2, &c2);
+
+	Window dummy;
+	int px, py, di;
+	unsigned int dui;
+	if (!XQueryPointer(dpy, root, &dummy, &dummy, &px, &py, &di, &di, &dui))
+		return;
+	if (XGrabPointer(dpy, root, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+			GrabModeAsync, GrabModeAsync, None, None, CurrentTime) != GrabSuccess)
+		return;
 
-	if (old && old != c) {
-		updateborder(old);
-		last_focused[old->workspace] = old;
-	}
+	// Offset of the grabbed cell inside the window's span (move only)
+	int pr, pc;
+	cell_at(mon, px, py, &pr, &pc);
+	int dr = pr - r1, dc = pc - c1;
+	int span_r = r2 - r1, span_c = c2 - c1;
+	int anchor_r = r1, anchor_c = c1;
+
+	Monitor *cur_mon = mon;
+	Time last = 0;
+	unsigned long interval = drag_refresh_hz ? 1000 / drag_refresh_hz : 0;
+	XEvent ev;
+	do {
+		if (sync_deadline && now_ns() >= sync_deadline)
+			synctimeout();
+		XIfEvent(dpy, &ev, dragevent, NULL);
+		if (ev.type != MotionNotify && ev.type != ButtonRelease) {
+			if (ev.type != ButtonPress)
+				handleevent(&ev);
+			continue;
+		}
+		if (ev.type == MotionNotify) {
+			// Only the latest pointer position matters
+			while (XCheckTypedWindowEvent(dpy, root, MotionNotify, &ev))
+				;
+			if (ev.xmotion.time - last < interval)
+				continue;
+			last = ev.xmotion.time;
+		}
+
+		int x = ev.type == MotionNotify ? ev.xmotion.x_root : ev.xbutton.x_root;
+		int y = ev.type == MotionNotify ? ev.xmotion.y_root : ev.xbutton.y_root;
+		Monitor *m = resizing ? mon : get_monitor_at(x, y);
+		int nr1, nc1, nr2, nc2;
+		cell_at(m, x, y, &pr, &pc);
+		if (resizing) {
+			nr1 = anchor_r < pr ? anchor_r : pr;
+			nr2 = anchor_r > pr ? anchor_r : pr;
+			nc1 = anchor_c < pc ? anchor_c : pc;
+			nc2 = anchor_c > pc ? anchor_c : pc;
+		} else {
+			nr1 = pr - dr;
+			nc1 = pc - dc;
+			if (nr1 < 0) nr1 = 0;
+			if (nc1 < 0) nc1 = 0;
+			if (nr1 + span_r >= GRID_ROWS) nr1 = GRID_ROWS - 1 - span_r;
+			if (nc1 + span_c >= GRID_COLS) nc1 = GRID_COLS - 1 - span_c;
+			nr2 = nr1 + span_r;
+			nc2 = nc1 + span_c;
+		}
+
+		if (m != cur_mon || nr1 != r1 || nc1 != c1 || nr2 != r2 || nc2 != c2) {
+			int wx, wy, ww, wh;
+			cur_mon = m;
+			r1 = nr1; c1 = nc1; r2 = nr2; c2 = nc2;
+			cell_geometry(m, r1, c1, r2, c2, &wx, &wy, &ww, &wh);
+			resize(c, wx, wy, ww, wh);
+			XFlush(dpy);
+		}
+	} while (ev.type != ButtonRelease);
+
+	XUngrabPointer(dpy, CurrentTime);
+	// A window dropped on another head joins the workspace shown there
+	if (cur_mon != mon)
+		setclientws(c, cur_mon->ws);
+	selmon(cur_mon);
+	restack(cur_mon);
+}
+
+static void movemouse(const Arg *arg) {
+	dragmouse(0);
+}
+
+static void resizemouse(const Arg *arg) {
+	dragmouse(1);
+}
+
+// Cache WM_PROTOCOLS, so focus and kill need no round trip, and the
+// counter of clients that support _NET_WM_SYNC_REQUEST
+static void updateprotocols(Client *c) {
+	Atom *protocols;
+	int n;
+
+	c->protocols = 0;
+	if (XGetWMProtocols(dpy, c->win, &protocols, &n)) {
+		while (n--)
+			c->protocols |= protocols[n] == wm_delete_window ? ProtoDelete :
+							protocols[n] == wm_take_focus ? ProtoTakeFocus :
+							protocols[n] == net_wm_sync_request ? ProtoSync : 0;
+		XFree(protocols);
+	}
+
+	XSyncCounter counter = None;
+	if (have_sync && (c->protocols & ProtoSync)) {
+		Atom real;
+		int format;
+		unsigned long nitems, after;
+		unsigned char *data = NULL;
+		if (XGetWindowProperty(dpy, c->win, net_wm_sync_request_counter, 0, 1, False, XA_CARDINAL,
+							   &real, &format, &nitems, &after, &data) == Success && data) {
+			if (nitems && format == 32)
+				counter = *(long *)data;
+			XFree(data);
+		}
+	}
+	if (counter != c->synccounter && c->syncalarm) {
+		XSyncDestroyAlarm(dpy, c->syncalarm);
+		c->syncalarm = None;
+		c->syncdeadline = 0;
+	}
+	c->synccounter = counter;
+	c->synctimeouts = 0;
+}
+
+// Ask the client to report, through its counter, when it has handled the
+// next resize, and arm an alarm for it
+static void syncrequest(Client *c) {
+	XSyncAlarmAttributes attr;
+	XEvent ev = {0};
+	unsigned long flags = XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+						  XSyncCATestType | XSyncCADelta | XSyncCAEvents;
+
+	c->syncvalue++;
+	attr.trigger.counter = c->synccounter;
+	attr.trigger.value_type = XSyncAbsolute;
+	XSyncIntsToValue(&attr.trigger.wait_value, c->syncvalue & 0xffffffff, c->syncvalue >> 32);
+	attr.trigger.test_type = XSyncPositiveComparison;
+	XSyncIntToValue(&attr.delta, 0);  // Fire once
+	attr.events = True;
+	if (c->syncalarm)
+		XSyncChangeAlarm(dpy, c->syncalarm, flags, &attr);
+	else
+		c->syncalarm = XSyncCreateAlarm(dpy, flags, &attr);
+
+	ev.type = ClientMessage;
+	ev.xclient.window = c->win;
+	ev.xclient.message_type = wm_protocols;
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = net_wm_sync_request;
+	ev.xclient.data.l[1] = CurrentTime;
+	ev.xclient.data.l[2] = c->syncvalue & 0xffffffff;
+	ev.xclient.data.l[3] = c->syncvalue >> 32;
+	XSendEvent(dpy, c->win, False, NoEventMask, &ev);
+
+	c->syncdeadline = now_ns() + sync_timeout_ms * 1000000ull;
+	if (!sync_deadline || c->syncdeadline < sync_deadline)
+		sync_deadline = c->syncdeadline;
+}
+
+// Core logic
+static void resize(Client *c, int x, int y, int w, int h) {
+	c->x = x; c->y = y; c->w = w; c->h = h;
+	invalidate(c->workspace);
+
+	// One resize in flight per sync client: later geometry waits for the
+	// client to catch up, and only the latest is sent then
+	if (c->syncdeadline) {
+		c->syncpending = 1;
+		return;
+	}
+	if (c->synccounter && c->mapped && (w != c->sentw || h != c->senth))
+		syncrequest(c);
+	// A parked window keeps its place off-screen until it is shown
+	XMoveResizeWindow(dpy, c->win, c->mapped || !park_hidden ? x : parkx(c), y, w, h);
+	c->sentw = w;
+	c->senth = h;
+}
+
+// The client has repainted after the last resize, or took too long
+static void syncdone(Client *c) {
+	c->syncdeadline = 0;
+	if (c->syncpending) {
+		c->syncpending = 0;
+		resize(c, c->x, c->y, c->w, c->h);
+	}
+}
+
+static void syncnotify(XEvent *e) {
+	XSyncAlarmNotifyEvent *ev = (XSyncAlarmNotifyEvent *)e;
+
+	for (int ws = 0; ws < 9; ws++)
+		for (Client *c = workspaces[ws]; c; c = c->next)
+			if (c->syncalarm == ev->alarm) {
+				// A late answer to a request that already timed out
+				unsigned long long v = (unsigned long long)XSyncValueHigh32(ev->counter_value) << 32 |
+									   XSyncValueLow32(ev->counter_value);
+				if (c->syncdeadline && v >= c->syncvalue) {
+					c->synctimeouts = 0;
+					syncdone(c);
+				}
+				return;
+			}
+}
+
+// Clients that did not answer in sync_timeout_ms get their latest
+// geometry anyway; pacing is only dropped after repeated misses
+static void synctimeout(void) {
+	uint64_t t = now_ns();
+
+	sync_deadline = 0;
+	for (int ws = 0; ws < 9; ws++)
+		for (Client *c = workspaces[ws]; c; c = c->next) {
+			if (c->syncdeadline && c->syncdeadline <= t) {
+				if (++c->synctimeouts >= SYNC_MAX_TIMEOUTS) {
+					XSyncDestroyAlarm(dpy, c->syncalarm);
+					c->syncalarm = None;
+					c->synccounter = None;
+				}
+				syncdone(c);
+			}
+			if (c->syncdeadline && (!sync_deadline || c->syncdeadline < sync_deadline))
+				sync_deadline = c->syncdeadline;
+		}
+}
+
+// Stacking layers, bottom to top. The grid overlay is an override-redirect
+// window mapped raised above all of them and is never part of a restack.
+enum { LayerTiled, LayerSpanning, LayerFullscreen };
+
+static int stacklayer(Client *c, Monitor *mon) {
+	int r1, c1, r2, c2;
+	if (c->isfullscreen) return LayerFullscreen;
+	cell_at(mon, c->x, c->y, &r1, &c1);
+	cell_at(mon, c->x + c->w - 1, c->y + c->h - 1, &r2, &c2);
+	return r1 != r2 || c1 != c2 ? LayerSpanning : LayerTiled;
+}
+
+// Bring the server's stacking order of the windows shown on mon in line
+// with the model: by layer, then by stackseq. Nothing is sent when the
+// order is unchanged, otherwise it goes out as one XRestackWindows.
+static void restack(Monitor *mon) {
+	static struct { Window win; unsigned long key; } *order = NULL;
+	static int ordercap = 0;
+	int n = 0;
+
+	if (!mon) return;
+
+	// A fullscreen monitor is left alone once its window is on top
+	Client *fs = fullscreenon(mon);
+	if (fs) {
+		if (mon->nstack != 1 || mon->stack[0] != fs->win) {
+			XRaiseWindow(dpy, fs->win);
+			if (!mon->stackcap) {
+				mon->stackcap = 1;
+				mon->stack = malloc(sizeof(Window));
+			}
+			mon->stack[0] = fs->win;
+			mon->nstack = 1;
+		}
+		return;
+	}
+
+	for (Client *c = workspaces[mon->ws]; c; c = c->next) {
+		if (!c->mapped || get_monitor_for_window(c) != mon) continue;
+		if (n == ordercap) {
+			ordercap = ordercap ? ordercap * 2 : 16;
+			order = realloc(order, ordercap * sizeof(*order));
+		}
+		order[n].win = c->win;
+		order[n].key = ((unsigned long)stacklayer(c, mon) << (sizeof(long) * 8 - 2)) | c->stackseq;
+		n++;
+	}
+
+	// Insertion sort, highest key first; n is small
+	for (int i = 1; i < n; i++) {
+		Window win = order[i].win;
+		unsigned long key = order[i].key;
+		int j = i;
+		for (; j > 0 && order[j - 1].key < key; j--)
+			order[j] = order[j - 1];
+		order[j].win = win;
+		order[j].key = key;
+	}
+
+	int same = n == mon->nstack;
+	for (int i = 0; same && i < n; i++)
+		same = order[i].win == mon->stack[i];
+	if (same) return;
+
+	if (n > mon->stackcap) {
+		mon->stackcap = n;
+		mon->stack = realloc(mon->stack, n * sizeof(Window));
+	}
+	for (int i = 0; i < n; i++)
+		mon->stack[i] = order[i].win;
+	mon->nstack = n;
+	if (n > 1)
+		XRestackWindows(dpy, mon->stack, n);
+}
+
+static void updateborder(Client *c) {
+	XSetWindowBorder(dpy, c->win, c == focused ? border_focused :
+					 c->marked ? border_marked : border_normal);
+}
+
+static void focus(Client *c, int warp) {
+	if (!c) return;
+
+	Client *old = focused;
+	focused = c;
+
+	if (old && old != c) {
+		updateborder(old);
+		last_focused[old->workspace] = old;
+	}
 
 	updateborder(c);
-	XRaiseWindow(dpy, c->win);
+	if (focus_raises)
+		c->stackseq = ++stackseq;
 	XSetInputFocus(dpy, c->win, RevertToPointerRoot, CurrentTime);
 	sendevent(c, wm_take_focus);
 
-	// Update current monitor based on focused window
-	current_monitor = get_monitor_for_window(c);
+	// Update current monitor based on focused window (once it has been placed)
+	if (c->w && c->h) {
+		selmon(get_monitor_for_window(c));
+		restack(current_monitor);
+	}
 
 	if (warp && !c->isfullscreen) {
 		int cursor_x = c->x + c->w - 16;
@@ -458,29 +1670,15 @@ static int is_cell_free(Monitor *mon, int r, int c, int cell_w, int cell_h) {
 	int cell_x = mon->x + padding + c * (cell_w + padding);
 	int cell_y = mon->y + padding + r * (cell_h + padding);
 
-	// Check if any window overlaps with this cell
-	for (Client *cl = workspaces[current_ws]; cl; cl = cl->next) {
-		if (cl->isfullscreen) continue;
-
-		// Check for overlap
-		int cl_right = cl->x + cl->w;
-		int cl_bottom = cl->y + cl->h;
-		int cell_right = cell_x + cell_w;
-		int cell_bottom = cell_y + cell_h;
-
-		// If rectangles overlap
-		if (!(cl_right <= cell_x || cl->x >= cell_right ||
-			  cl_bottom <= cell_y || cl->y >= cell_bottom)) {
-			return 0;  // Cell is occupied
-		}
-	}
-
-	return 1;  // Cell is free
+	// Check if any (non-fullscreen) window overlaps with this cell
+	return !rects_overlap(clientrects(mon->ws), cell_x, cell_y,
+						  cell_x + cell_w, cell_y + cell_h, RectFullscreen);
 }
 
 static void find_next_free_cell(Monitor *mon, int *out_r, int *out_c) {
 	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
 	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	RectSet *rects = clientrects(mon->ws);
 
 	// First pass: look for any completely free cell
 	for (int r = 0; r < GRID_ROWS; r++) {
@@ -493,38 +1691,20 @@ static void find_next_free_cell(Monitor *mon, int *out_r, int *out_c) {
 		}
 	}
 
-	// Second pass: no free space found, check top-left for 1x1 windows
-	int cell_x = mon->x + padding;
-	int cell_y = mon->y + padding;
-
-	for (Client *cl = workspaces[current_ws]; cl; cl = cl->next) {
-		if (cl->isfullscreen) continue;
-		if (cl->x == cell_x && cl->y == cell_y &&
-			cl->w == cell_w && cl->h == cell_h) {
-			// Found a 1x1 window at top-left, find next free cell
-			for (int r = 0; r < GRID_ROWS; r++) {
-				for (int c = 0; c < GRID_COLS; c++) {
-					int check_x = mon->x + padding + c * (cell_w + padding);
-					int check_y = mon->y + padding + r * (cell_h + padding);
-
-					int found_1x1 = 0;
-					for (Client *check = workspaces[current_ws]; check; check = check->next) {
-						if (check->isfullscreen) continue;
-						if (check->x == check_x && check->y == check_y &&
-							check->w == cell_w && check->h == cell_h) {
-							found_1x1 = 1;
-							break;
-						}
-					}
-
-					if (!found_1x1) {
-						*out_r = r;
-						*out_c = c;
-						return;
-					}
+	// Second pass: no free space found; if a 1x1 window sits top-left,
+	// use the first cell not holding a 1x1 window
+	if (rects_match(rects, mon->x + padding, mon->y + padding, cell_w, cell_h, RectFullscreen)) {
+		for (int r = 0; r < GRID_ROWS; r++) {
+			for (int c = 0; c < GRID_COLS; c++) {
+				int check_x = mon->x + padding + c * (cell_w + padding);
+				int check_y = mon->y + padding + r * (cell_h + padding);
+
+				if (!rects_match(rects, check_x, check_y, cell_w, cell_h, RectFullscreen)) {
+					*out_r = r;
+					*out_c = c;
+					return;
 				}
 			}
-			break;
 		}
 	}
 
@@ -533,126 +1713,374 @@ static void find_next_free_cell(Monitor *mon, int *out_r, int *out_c) {
 	*out_c = 0;
 }
 
-static void arrange(void) {
-	if (!workspaces[current_ws]) return;
+// Rebuild mon->sat from the current workspace: sat[r][c] is the number
+// of occupied cells in rows < r and columns < c.
+static void build_occupancy(Monitor *mon) {
+	unsigned char occ[GRID_ROWS][GRID_COLS];
+	memset(occ, 0, sizeof(occ));
 
-	if (!focused) focused = workspaces[current_ws];
+	for (Client *cl = workspaces[mon->ws]; cl; cl = cl->next) {
+		if (cl->isfullscreen || cl->w == 0 || cl->h == 0) continue;
+		if (cl->x + cl->w <= mon->x || cl->x >= mon->x + mon->w ||
+			cl->y + cl->h <= mon->y || cl->y >= mon->y + mon->h)
+			continue;
 
-	if (focused && focused->isfullscreen) {
-		return;
+		int r1, c1, r2, c2;
+		cell_at(mon, cl->x, cl->y, &r1, &c1);
+		cell_at(mon, cl->x + cl->w - 1, cl->y + cl->h - 1, &r2, &c2);
+		for (int r = r1; r <= r2; r++)
+			for (int c = c1; c <= c2; c++)
+				occ[r][c] = 1;
 	}
 
-	// Arrange windows on each monitor
-	if (current_monitor) {
-		arrange_monitor(current_monitor);
+	for (int c = 0; c <= GRID_COLS; c++)
+		mon->sat[0][c] = 0;
+	for (int r = 0; r < GRID_ROWS; r++) {
+		int row = 0;
+		mon->sat[r + 1][0] = 0;
+		for (int c = 0; c < GRID_COLS; c++) {
+			row += occ[r][c];
+			mon->sat[r + 1][c + 1] = mon->sat[r][c + 1] + row;
+		}
 	}
-	
-	for (Monitor *mon = monitors; mon; mon = mon->next) {
-		if (mon != current_monitor) {
-			arrange_monitor(mon);
+}
+
+// Number of occupied cells in the span (r1, c1)-(r2, c2), from mon->sat
+static int span_used(Monitor *mon, int r1, int c1, int r2, int c2) {
+	return mon->sat[r2 + 1][c2 + 1] - mon->sat[r1][c2 + 1]
+		 - mon->sat[r2 + 1][c1] + mon->sat[r1][c1];
+}
+
+// First empty span of rows x cols cells in row-major order
+static int fit_free_span(Monitor *mon, int rows, int cols, int *r1, int *c1) {
+	for (int r = 0; r + rows <= GRID_ROWS; r++)
+		for (int c = 0; c + cols <= GRID_COLS; c++)
+			if (!span_used(mon, r, c, r + rows - 1, c + cols - 1)) {
+				*r1 = r;
+				*c1 = c;
+				return 1;
+			}
+	return 0;
+}
+
+// Largest empty rectangular span, using the maximal-rectangle-in-histogram
+// method over the rows of mon->sat. O(rows * cols), no allocation.
+static int largest_free_span(Monitor *mon, int *r1, int *c1, int *r2, int *c2) {
+	int height[GRID_COLS + 1] = {0};
+	int stack[GRID_COLS + 1];
+	int best = 0;
+
+	for (int r = 0; r < GRID_ROWS; r++) {
+		for (int c = 0; c < GRID_COLS; c++)
+			height[c] = span_used(mon, r, c, r, c) ? 0 : height[c] + 1;
+
+		// height[GRID_COLS] stays 0 and flushes the stack
+		int top = 0;
+		for (int c = 0; c <= GRID_COLS; c++) {
+			while (top > 0 && height[stack[top - 1]] >= height[c]) {
+				int h = height[stack[--top]];
+				int left = top > 0 ? stack[top - 1] + 1 : 0;
+				int area = h * (c - left);
+				if (area > best) {
+					best = area;
+					*r1 = r - h + 1;
+					*c1 = left;
+					*r2 = r;
+					*c2 = c - 1;
+				}
+			}
+			stack[top++] = c;
 		}
 	}
+	return best > 0;
+}
 
-	// Update all borders
-	for (Client *c = workspaces[current_ws]; c; c = c->next)
-		updateborder(c);
+// Free space for a window on mon according to the placement policy. With
+// PlaceLargestSpan a rows x cols request is honoured when it fits anywhere;
+// pass 0 for no size preference.
+static void find_free_span(Monitor *mon, int rows, int cols, int *r1, int *c1, int *r2, int *c2) {
+	if (placement == PlaceLargestSpan) {
+		build_occupancy(mon);
+		if (rows > 0 && cols > 0 && fit_free_span(mon, rows, cols, r1, c1)) {
+			*r2 = *r1 + rows - 1;
+			*c2 = *c1 + cols - 1;
+			return;
+		}
+		if (largest_free_span(mon, r1, c1, r2, c2))
+			return;
+	}
+
+	find_next_free_cell(mon, r1, c1);
+	*r2 = *r1;
+	*c2 = *c1;
+}
+
+static void arrange(void) {
+	if (!workspaces[current_ws]) return;
+
+	if (!focused) focused = workspaces[current_ws];
+
+	// Arrange windows on each monitor; a fullscreen one gets no WM work
+	for (Monitor *mon = monitors; mon; mon = mon->next)
+		if (!fullscreenon(mon))
+			arrange_monitor(mon);
 }
 
 static void arrange_monitor(Monitor *mon) {
 	if (!mon) return;
 	
-	// Default window location - find next free cell on this monitor
+	// Default window location - new windows go to free space on the current monitor
+	if (focused && (focused->w == 0 || focused->h == 0) &&
+		mon == (current_monitor ? current_monitor : monitors)) {
+		int r1, c1, r2, c2, x, y, w, h;
+		find_free_span(mon, 0, 0, &r1, &c1, &r2, &c2);
+		cell_geometry(mon, r1, c1, r2, c2, &x, &y, &w, &h);
+		resize(focused, x, y, w, h);
+	}
+
+	// Update borders of the windows shown on this monitor
+	for (Client *c = workspaces[mon->ws]; c; c = c->next)
+		if (c->mapped && get_monitor_for_window(c) == mon)
+			updateborder(c);
+}
+
+// Grid cell containing the point (x, y), clamped to the grid of mon
+static void cell_at(Monitor *mon, int x, int y, int *r, int *c) {
 	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
 	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	int lx = x - mon->x - (int)padding;
+	int ly = y - mon->y - (int)padding;
+
+	*c = lx < 0 ? 0 : lx / (cell_w + (int)padding);
+	*r = ly < 0 ? 0 : ly / (cell_h + (int)padding);
+	if (*c >= GRID_COLS) *c = GRID_COLS - 1;
+	if (*r >= GRID_ROWS) *r = GRID_ROWS - 1;
+}
+
+// Root geometry of the cell span (r1, c1)-(r2, c2) on mon, corners inclusive
+static void cell_geometry(Monitor *mon, int r1, int c1, int r2, int c2, int *x, int *y, int *w, int *h) {
+	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
+	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	int cols_span = c2 - c1 + 1;
+	int rows_span = r2 - r1 + 1;
+
+	*x = mon->x + padding + c1 * (cell_w + padding);
+	*y = mon->y + padding + r1 * (cell_h + padding);
+	*w = cols_span * cell_w + (cols_span - 1) * padding;
+	*h = rows_span * cell_h + (rows_span - 1) * padding;
+}
+
+// Look up the grid cell labelled ch; returns 0 if ch is not a grid label
+static int cell_of(char ch, int *r, int *c) {
+	int i = gridcell[(unsigned char)ch];
+	if (!ch || i < 0) return 0;
+	*r = i / GRID_COLS;
+	*c = i % GRID_COLS;
+	return 1;
+}
+
+static void draw_overlay_cell(Drawable d, XftDraw *xd, int x, int y,
+							  int cell_w, int cell_h, char label, int selected) {
+	if (selected) {
+		XSetForeground(dpy, gc, xft_col_selection.pixel);
+		XFillRectangle(dpy, d, gc, x, y, cell_w, cell_h);
+	}
+
+	XSetForeground(dpy, gc, xft_col_foreground.pixel);
+	XDrawRectangle(dpy, d, gc, x, y, cell_w, cell_h);
+
+	if (font && xd) {
+		char txt[2] = {label, 0};
+		XGlyphInfo extents;
+		XftTextExtentsUtf8(dpy, font, (FcChar8*)txt, strlen(txt), &extents);
+
+		int tx = x + (cell_w - extents.width) / 2;
+		int ty = y + (cell_h - extents.height) / 2 + extents.y;
 
-	if (focused && (focused->w == 0 || focused->h == 0)) {
-		Monitor *focus_mon = current_monitor ? current_monitor : mon;
-		int r, c;
-		find_next_free_cell(focus_mon, &r, &c);
-		int x = focus_mon->x + padding + c * (cell_w + padding);
-		int y = focus_mon->y + padding + r * (cell_h + padding);
-		resize(focused, x, y, cell_w, cell_h);
+		XftDrawStringUtf8(xd, &xft_col_foreground, font, tx, ty,
+						(FcChar8*)txt, strlen(txt));
 	}
 }
 
-static void draw_overlay(void) {
-	if (!overlay_win) return;
+// Create the overlay window for a monitor. The idle grid is rendered once
+// into a pixmap that becomes the window background, so mapping the overlay
+// needs no drawing from us.
+static void create_overlay(Monitor *mon) {
+	Visual *visual = DefaultVisual(dpy, screen);
+	Colormap cmap = DefaultColormap(dpy, screen);
 
-	XClearWindow(dpy, overlay_win);
+	if (!gc)
+		gc = XCreateGC(dpy, root, 0, NULL);
 
-	// Use current monitor for overlay if available
-	Monitor *mon = current_monitor ? current_monitor : monitors;
-	if (!mon) return;
+	Pixmap bg = XCreatePixmap(dpy, root, mon->w, mon->h, DefaultDepth(dpy, screen));
+	XSetForeground(dpy, gc, xft_col_background.pixel);
+	XFillRectangle(dpy, bg, gc, 0, 0, mon->w, mon->h);
 
 	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
 	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	XftDraw *xd = XftDrawCreate(dpy, bg, visual, cmap);
+	for (int r = 0; r < GRID_ROWS; r++)
+		for (int c = 0; c < GRID_COLS; c++)
+			draw_overlay_cell(bg, xd, padding + c * (cell_w + padding),
+							  padding + r * (cell_h + padding),
+							  cell_w, cell_h, grid_chars[r][c], 0);
+	XftDrawDestroy(xd);
+
+	XSetWindowAttributes wa = {
+		.override_redirect = True,
+		.background_pixmap = bg,
+		.event_mask = ExposureMask | KeyPressMask
+	};
+	mon->overlay = XCreateWindow(dpy, root, mon->x, mon->y, mon->w, mon->h, 0,
+		CopyFromParent, InputOutput, CopyFromParent,
+		CWOverrideRedirect | CWBackPixmap | CWEventMask, &wa);
+	XFreePixmap(dpy, bg);  // the window keeps its own reference
+
+	mon->overlay_draw = XftDrawCreate(dpy, mon->overlay, visual, cmap);
+
+	unsigned long opacity = (unsigned long)(0.85 * 0xffffffff);
+	Atom atom = XInternAtom(dpy, "_NET_WM_WINDOW_OPACITY", False);
+	XChangeProperty(dpy, mon->overlay, atom, XA_CARDINAL, 32,
+				   PropModeReplace, (unsigned char *)&opacity, 1);
+}
 
-	int r1 = -1, c1 = -1, r2 = -1, c2 = -1;
-	if (overlay_input[0]) {
-		for (int r = 0; r < GRID_ROWS; r++)
-			for (int c = 0; c < GRID_COLS; c++)
-				if (grid_chars[r][c] == overlay_input[0]) { r1 = r; c1 = c; }
+// Thumbnail of c: thumb_scale of its cell span, centred in it
+static void thumbgeom(Client *c, int *x, int *y, int *w, int *h) {
+	*w = c->w * thumb_scale;
+	*h = c->h * thumb_scale;
+	*x = c->x + (c->w - *w) / 2;
+	*y = c->y + (c->h - *h) / 2;
+}
+
+// Re-render the cached thumbnail of c from its window contents, if the
+// window was damaged or resized since the last time
+static void updatethumb(Client *c) {
+	int x, y, w, h;
+
+	thumbgeom(c, &x, &y, &w, &h);
+	if (w < 1 || h < 1) return;
+	if (!c->thumb || c->thumbw != w || c->thumbh != h) {
+		if (c->thumb)
+			XFreePixmap(dpy, c->thumb);
+		c->thumb = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+		c->thumbw = w;
+		c->thumbh = h;
+		c->thumbdirty = 1;
 	}
-	if (overlay_input[1]) {
-		for (int r = 0; r < GRID_ROWS; r++)
-			for (int c = 0; c < GRID_COLS; c++)
-				if (grid_chars[r][c] == overlay_input[1]) { r2 = r; c2 = c; }
+	if (!c->thumbdirty) return;
+	c->thumbdirty = 0;
+	XDamageSubtract(dpy, c->damage, None, None);  // Re-arm before reading
+
+	// The named pixmap includes the border
+	int bw = c->isfullscreen ? 0 : border_width;
+	Pixmap src = XCompositeNameWindowPixmap(dpy, c->win);
+	Picture from = XRenderCreatePicture(dpy, src, c->format, 0, NULL);
+	Picture to = XRenderCreatePicture(dpy, c->thumb, rootfmt, 0, NULL);
+	XTransform scale = {{
+		{ XDoubleToFixed((double)(c->w + 2 * bw) / w), 0, 0 },
+		{ 0, XDoubleToFixed((double)(c->h + 2 * bw) / h), 0 },
+		{ 0, 0, XDoubleToFixed(1) }
+	}};
+	XRenderSetPictureTransform(dpy, from, &scale);
+	XRenderSetPictureFilter(dpy, from, FilterBilinear, NULL, 0);
+	XRenderComposite(dpy, PictOpSrc, from, None, to, 0, 0, 0, 0, 0, 0, w, h);
+	XRenderFreePicture(dpy, from);
+	XRenderFreePicture(dpy, to);
+	XFreePixmap(dpy, src);
+}
+
+// Whether cell r, col is part of the span typed so far
+static int overlay_selected(int r, int col) {
+	int r1, c1, r2, c2;
+	if (!cell_of(overlay_input[0], &r1, &c1))
+		return 0;
+	if (!cell_of(overlay_input[1], &r2, &c2)) {
+		r2 = r1;
+		c2 = c1;
 	}
+	return r >= (r1 < r2 ? r1 : r2) && r <= (r1 > r2 ? r1 : r2) &&
+		   col >= (c1 < c2 ? c1 : c2) && col <= (c1 > c2 ? c1 : c2);
+}
 
-	for (int r = 0; r < GRID_ROWS; r++) {
-		for (int c = 0; c < GRID_COLS; c++) {
-			// Use LOCAL coordinates (relative to overlay_win, not root)
-			int x = padding + c * (cell_w + padding);
-			int y = padding + r * (cell_h + padding);
-
-			int is_selected = 0;
-			if (r1 >= 0 && c1 >= 0) {
-				if (r2 >= 0 && c2 >= 0) {
-					int min_r = r1 < r2 ? r1 : r2;
-					int max_r = r1 > r2 ? r1 : r2;
-					int min_c = c1 < c2 ? c1 : c2;
-					int max_c = c1 > c2 ? c1 : c2;
-					if (r >= min_r && r <= max_r && c >= min_c && c <= max_c)
-						is_selected = 1;
-				} else if (r == r1 && c == c1) {
-					is_selected = 1;
-				}
-			}
+// Thumbnail of c, with the labels of the cells it covers drawn back on top
+static void drawthumb(Monitor *mon, Client *c) {
+	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
+	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	int x, y, w, h, r1, c1, r2, c2;
+
+	updatethumb(c);
+	thumbgeom(c, &x, &y, &w, &h);
+	XCopyArea(dpy, c->thumb, mon->overlay, gc, 0, 0, w, h, x - mon->x, y - mon->y);
+
+	cell_at(mon, c->x, c->y, &r1, &c1);
+	cell_at(mon, c->x + c->w - 1, c->y + c->h - 1, &r2, &c2);
+	for (int r = r1; r <= r2; r++)
+		for (int col = c1; col <= c2; col++)
+			draw_overlay_cell(mon->overlay, mon->overlay_draw,
+							  padding + col * (cell_w + padding),
+							  padding + r * (cell_h + padding),
+							  cell_w, cell_h, grid_chars[r][col], overlay_selected(r, col));
+}
 
-			if (is_selected) {
-				XSetForeground(dpy, gc, xft_col_selection.pixel);
-				XFillRectangle(dpy, overlay_win, gc, x, y, cell_w, cell_h);
-			}
+static int hasthumb(Monitor *mon, Client *c) {
+	// Fullscreen windows are unredirected and have no pixmap to read
+	return c->mapped && c->w && c->damage && !c->isfullscreen &&
+		   get_monitor_for_window(c) == mon;
+}
 
-			XSetForeground(dpy, gc, xft_col_foreground.pixel);
-			XDrawRectangle(dpy, overlay_win, gc, x, y, cell_w, cell_h);
+// Thumbnails of the windows shown on mon
+static void drawthumbs(Monitor *mon) {
+	for (Client *c = workspaces[mon->ws]; c; c = c->next)
+		if (hasthumb(mon, c))
+			drawthumb(mon, c);
+}
 
-			if (font && xftdraw) {
-				char txt[2] = {grid_chars[r][c], 0};
-				XGlyphInfo extents;
-				XftTextExtentsUtf8(dpy, font, (FcChar8*)txt, strlen(txt), &extents);
+// Draw the current selection over the pre-rendered grid
+static void draw_overlay(void) {
+	Monitor *mon = overlay_mon;
+	if (!mon) return;
 
-				int tx = x + (cell_w - extents.width) / 2;
-				int ty = y + (cell_h - extents.height) / 2 + extents.y;
+	XClearWindow(dpy, mon->overlay);
+	if (have_thumbs)
+		drawthumbs(mon);
+	if (!overlay_input[0] && !overlay_input[1]) {
+		XFlush(dpy);
+		return;
+	}
 
-				XftDrawStringUtf8(xftdraw, &xft_col_foreground, font, tx, ty,
-								(FcChar8*)txt, strlen(txt));
-			}
-		}
+	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
+	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+
+	int r1 = -1, c1 = -1, r2 = -1, c2 = -1;
+	cell_of(overlay_input[0], &r1, &c1);
+	cell_of(overlay_input[1], &r2, &c2);
+
+	if (r1 >= 0 && c1 >= 0) {
+		if (r2 < 0 || c2 < 0) { r2 = r1; c2 = c1; }
+		int min_r = r1 < r2 ? r1 : r2;
+		int max_r = r1 > r2 ? r1 : r2;
+		int min_c = c1 < c2 ? c1 : c2;
+		int max_c = c1 > c2 ? c1 : c2;
+
+		for (int r = min_r; r <= max_r; r++)
+			for (int c = min_c; c <= max_c; c++)
+				// Use LOCAL coordinates (relative to the overlay, not root)
+				draw_overlay_cell(mon->overlay, mon->overlay_draw,
+								  padding + c * (cell_w + padding),
+								  padding + r * (cell_h + padding),
+								  cell_w, cell_h, grid_chars[r][c], 1);
 	}
 
-	if (overlay_input[0] || overlay_input[1]) {
-		char status[64];
-		snprintf(status, sizeof(status), "Input: %c%c",
-				overlay_input[0] ? overlay_input[0] : ' ',
-				overlay_input[1] ? overlay_input[1] : ' ');
+	char status[64];
+	snprintf(status, sizeof(status), "Input: %c%c",
+			overlay_input[0] ? overlay_input[0] : ' ',
+			overlay_input[1] ? overlay_input[1] : ' ');
 
-		if (font && xftdraw) {
-			// Use LOCAL coordinates
-			XftDrawStringUtf8(xftdraw, &xft_col_foreground, font, 
-							20, mon->h - 20,
-							(FcChar8*)status, strlen(status));
-		}
+	if (font) {
+		// Use LOCAL coordinates
+		XftDrawStringUtf8(mon->overlay_draw, &xft_col_foreground, font,
+						20, mon->h - 20,
+						(FcChar8*)status, strlen(status));
 	}
 
 	XFlush(dpy);
@@ -661,48 +2089,25 @@ static void draw_overlay(void) {
 static void enter_overlay(const Arg *arg) {
 	if (!focused) return;
 
-	overlay_mode = 1;
-	memset(overlay_input, 0, sizeof(overlay_input));
+	load_font();
 
 	Monitor *mon = current_monitor ? current_monitor : monitors;
 	if (!mon) return;
 
-	if (!overlay_win) {
-		XSetWindowAttributes wa = {
-			.override_redirect = True,
-			.background_pixel = xft_col_background.pixel,
-			.event_mask = ExposureMask | KeyPressMask
-		};
-		overlay_win = XCreateWindow(dpy, root, mon->x, mon->y, mon->w, mon->h, 0,
-			CopyFromParent, InputOutput, CopyFromParent,
-			CWOverrideRedirect | CWBackPixel | CWEventMask, &wa);
-
-		gc = XCreateGC(dpy, overlay_win, 0, NULL);
-
-		Visual *visual = DefaultVisual(dpy, DefaultScreen(dpy));
-		Colormap cmap = DefaultColormap(dpy, DefaultScreen(dpy));
-		xftdraw = XftDrawCreate(dpy, overlay_win, visual, cmap);
-
-		unsigned long opacity = (unsigned long)(0.85 * 0xffffffff);
-		Atom atom = XInternAtom(dpy, "_NET_WM_WINDOW_OPACITY", False);
-		XChangeProperty(dpy, overlay_win, atom, XA_CARDINAL, 32,
-					   PropModeReplace, (unsigned char *)&opacity, 1);
-	} else {
-		// Reposition overlay to current monitor
-		XMoveResizeWindow(dpy, overlay_win, mon->x, mon->y, mon->w, mon->h);
-		XClearWindow(dpy, overlay_win);  // Force redraw
-	}
+	overlay_mode = 1;
+	overlay_mon = mon;
+	memset(overlay_input, 0, sizeof(overlay_input));
 
-	XMapRaised(dpy, overlay_win);
-	XSetInputFocus(dpy, overlay_win, RevertToPointerRoot, CurrentTime);
-	draw_overlay();
+	XMapRaised(dpy, mon->overlay);
+	XSetInputFocus(dpy, mon->overlay, RevertToPointerRoot, CurrentTime);
 }
 
 static void hide_overlay(void) {
 	overlay_mode = 0;
 	memset(overlay_input, 0, sizeof(overlay_input));
-	if (overlay_win) {
-		XUnmapWindow(dpy, overlay_win);
+	if (overlay_mon) {
+		XUnmapWindow(dpy, overlay_mon->overlay);
+		overlay_mon = NULL;
 	}
 	if (focused) {
 		XSetInputFocus(dpy, focused->win, RevertToPointerRoot, CurrentTime);
@@ -712,123 +2117,430 @@ static void hide_overlay(void) {
 static void process_overlay_input(void) {
 	if (!focused || overlay_input[0] == 0 || overlay_input[1] == 0) return;
 
-	int r1 = -1, c1 = -1, r2 = -1, c2 = -1;
-	for (int r = 0; r < GRID_ROWS; r++) {
-		for (int c = 0; c < GRID_COLS; c++) {
-			if (grid_chars[r][c] == overlay_input[0]) { r1 = r; c1 = c; }
-			if (grid_chars[r][c] == overlay_input[1]) { r2 = r; c2 = c; }
-		}
-	}
-	if (r1 == -1 || r2 == -1) return;
+	int r1, c1, r2, c2;
+	if (!cell_of(overlay_input[0], &r1, &c1) || !cell_of(overlay_input[1], &r2, &c2))
+		return;
 
 	if (r1 > r2) { int t = r1; r1 = r2; r2 = t; }
 	if (c1 > c2) { int t = c1; c1 = c2; c2 = t; }
 
-	int cols_span = c2 - c1 + 1;
-	int rows_span = r2 - r1 + 1;
-
 	Monitor *mon = current_monitor ? current_monitor : monitors;
 	if (!mon) return;
 
-	int cell_w = (mon->w - padding * (GRID_COLS + 1)) / GRID_COLS;
-	int cell_h = (mon->h - padding * (GRID_ROWS + 1)) / GRID_ROWS;
+	int x, y, w, h, n;
+	cell_geometry(mon, r1, c1, r2, c2, &x, &y, &w, &h);
+
+	Client **t = gettargets(&n);
+	for (int i = 0; i < n; i++) {
+		resize(t[i], x, y, w, h);
+		setclientws(t[i], mon->ws);
+		updatevisibility(t[i]);
+	}
+	endbatch();
+	if (focused) focus(focused, 1);
+}
+
+// Workspace functions
+static void switchws(const Arg *arg) {
+	int ws = arg->i;
+	Monitor *mon = current_monitor;
+	if (!mon || ws < 0 || ws >= 9 || ws == mon->ws) return;
+	
+	if (focused) {
+		last_focused[focused->workspace] = focused;
+	}
+
+	// Only windows on the current monitor change visibility; the whole
+	// switch goes out as one batch under a server grab
+	XGrabServer(dpy);
+	for (Client *c = workspaces[mon->ws]; c; c = c->next)
+		if (get_monitor_for_window(c) == mon)
+			hideclient(c);
+
+	mon->ws = ws;
+	current_ws = ws;
+
+	for (Client *c = workspaces[ws]; c; c = c->next)
+		if (get_monitor_for_window(c) == mon)
+			showclient(c);
+	XUngrabServer(dpy);
+	
+	// Restore the last focus on this WS, otherwise the first one
+	Client *c = last_focused[ws];
+	if (!c || !c->mapped || get_monitor_for_window(c) != mon)
+		c = firstvisible(mon);
+
+	if (c) {
+		focus(c, 1);
+	} else {
+		focused = NULL;
+		XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
+	}
+
+	arrange_monitor(mon);
+}
+
+static void movewin_to_ws(const Arg *arg) {
+	int ws = arg->i, n;
+	if (ws < 0 || ws >= 9) return;
+	
+	Client **t = gettargets(&n);
+	if (!n) return;
+	for (int i = 0; i < n; i++) {
+		if (t[i]->workspace == ws) continue;
+		// Border, geometry and the compositor hint come back with the state
+		setfullscreen(t[i], 0);
+		setclientws(t[i], ws);
+		// Hide the windows we just moved, unless their monitor shows ws
+		updatevisibility(t[i]);
+	}
+	endbatch();
+	
+	// Update focus to next available window on this monitor
+	if (!focused || !focused->mapped) {
+		Client *next = current_monitor ? firstvisible(current_monitor) : NULL;
+		if (next) {
+			focus(next, 0);
+		} else {
+			focused = NULL;
+		}
+	}
+	
+	// Re-arrange once for the whole batch
+	arrange();
+}
+
+// Selection. Batch actions (move to workspace or monitor, place, kill)
+// apply to all marked clients, or to the focused one if none is marked.
+static void setmark(Client *c, int marked) {
+	if (c->marked == marked) return;
+	c->marked = marked;
+	nmarked += marked ? 1 : -1;
+	updateborder(c);
+}
+
+static void togglemark(const Arg *arg) {
+	if (focused)
+		setmark(focused, !focused->marked);
+}
+
+static void clearmarks(const Arg *arg) {
+	for (int i = 0; i < 9 && nmarked; i++)
+		for (Client *c = workspaces[i]; c; c = c->next)
+			setmark(c, 0);
+}
+
+// Snapshot of the clients an action applies to, valid until the next call
+static Client **gettargets(int *n) {
+	static Client **buf = NULL;
+	static int cap = 0;
+
+	*n = 0;
+	if (!nmarked) {
+		if (focused) {
+			if (!cap) buf = realloc(buf, (cap = 16) * sizeof(Client *));
+			buf[(*n)++] = focused;
+		}
+		return buf;
+	}
+	for (int i = 0; i < 9; i++) {
+		for (Client *c = workspaces[i]; c; c = c->next) {
+			if (!c->marked) continue;
+			if (*n == cap) {
+				cap = cap ? cap * 2 : 16;
+				buf = realloc(buf, cap * sizeof(Client *));
+			}
+			buf[(*n)++] = c;
+		}
+	}
+	return buf;
+}
+
+// Show or hide a client according to the workspace of the monitor it is on
+static void updatevisibility(Client *c) {
+	if (get_monitor_for_window(c)->ws == c->workspace)
+		showclient(c);
+	else
+		hideclient(c);
+}
+
+// Finish a batch action: the selection is consumed and all requests go out together
+static void endbatch(void) {
+	if (nmarked)
+		clearmarks(NULL);
+	XFlush(dpy);
+}
+
+// Layout snapshots. A snapshot stores the cell span of each client on the
+// current workspace, keyed by WM_CLASS and WM_WINDOW_ROLE, in
+// $XDG_STATE_HOME/gbwm/<name>.layout (one tab-separated line per client).
+#define LAYOUT_FIELD 128
+
+typedef struct {
+	char class[LAYOUT_FIELD], instance[LAYOUT_FIELD], role[LAYOUT_FIELD];
+} WinId;
+
+static void getwinid(Window win, WinId *id) {
+	XClassHint ch = {NULL, NULL};
+	XTextProperty tp;
+
+	strcpy(id->class, "-");
+	strcpy(id->instance, "-");
+	strcpy(id->role, "-");
+	if (XGetClassHint(dpy, win, &ch)) {
+		if (ch.res_class && *ch.res_class)
+			snprintf(id->class, sizeof(id->class), "%s", ch.res_class);
+		if (ch.res_name && *ch.res_name)
+			snprintf(id->instance, sizeof(id->instance), "%s", ch.res_name);
+		if (ch.res_class) XFree(ch.res_class);
+		if (ch.res_name) XFree(ch.res_name);
+	}
+	if (XGetTextProperty(dpy, win, &tp, wm_window_role)) {
+		if (tp.value && tp.encoding == XA_STRING && *tp.value)
+			snprintf(id->role, sizeof(id->role), "%s", (char *)tp.value);
+		if (tp.value) XFree(tp.value);
+	}
+	// Tabs and newlines would break the file format
+	for (char *p = id->role; *p; p++)
+		if (*p == '\t' || *p == '\n') *p = ' ';
+}
+
+static int layout_path(const char *name, char *buf, size_t size, int create) {
+	const char *state = getenv("XDG_STATE_HOME");
+	const char *home = getenv("HOME");
+	char dir[512];
+
+	if (state && *state)
+		snprintf(dir, sizeof(dir), "%s/gbwm", state);
+	else if (home && *home)
+		snprintf(dir, sizeof(dir), "%s/.local/state/gbwm", home);
+	else
+		return 0;
+
+	if (create) {
+		// Create the parent directories one level at a time
+		for (char *p = dir + 1; *p; p++) {
+			if (*p != '/') continue;
+			*p = 0;
+			if (mkdir(dir, 0755) < 0 && errno != EEXIST) return 0;
+			*p = '/';
+		}
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) return 0;
+	}
+	snprintf(buf, size, "%s/%s.layout", dir, name);
+	return 1;
+}
+
+static void savelayout(const Arg *arg) {
+	char path[640];
+	FILE *f;
+
+	if (!layout_path(arg->v, path, sizeof(path), 1) || !(f = fopen(path, "w"))) {
+		fprintf(stderr, "gbwm: cannot save layout %s\n", (const char *)arg->v);
+		return;
+	}
+
+	for (Client *c = workspaces[current_ws]; c; c = c->next) {
+		if (c->isfullscreen || c->w == 0 || c->h == 0) continue;
+
+		WinId id;
+		Monitor *mon = get_monitor_for_window(c);
+		int r1, c1, r2, c2;
+		getwinid(c->win, &id);
+		cell_at(mon, c->x, c->y, &r1, &c1);
+		cell_at(mon, c->x + c->w - 1, c->y + c->h - 1, &r2, &c2);
+		fprintf(f, "%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\n",
+				id.class, id.instance, id.role, mon->num, r1, c1, r2, c2);
+	}
+	fclose(f);
+}
+
+// Restore a snapshot onto the current workspace. Every target geometry is
+// computed first, then all clients are configured under one server grab so
+// each application sees a single ConfigureNotify.
+static void restorelayout(const Arg *arg) {
+	char path[640], line[4 * LAYOUT_FIELD];
+	int n = 0;
+	FILE *f;
+
+	if (!layout_path(arg->v, path, sizeof(path), 0) || !(f = fopen(path, "r")))
+		return;
+
+	for (Client *c = workspaces[current_ws]; c; c = c->next)
+		n++;
+	if (!n) {
+		fclose(f);
+		return;
+	}
+
+	struct { Client *c; WinId id; Monitor *mon; int x, y, w, h, set; } *t = calloc(n, sizeof(*t));
+	int i = 0;
+	for (Client *c = workspaces[current_ws]; c; c = c->next, i++) {
+		t[i].c = c;
+		getwinid(c->win, &t[i].id);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		WinId id;
+		int num, r1, c1, r2, c2;
+		if (sscanf(line, "%127[^\t]\t%127[^\t]\t%127[^\t]\t%d\t%d\t%d\t%d\t%d",
+				   id.class, id.instance, id.role, &num, &r1, &c1, &r2, &c2) != 8)
+			continue;
+		if (r1 < 0 || c1 < 0 || r2 < r1 || c2 < c1 || r2 >= GRID_ROWS || c2 >= GRID_COLS)
+			continue;
+
+		// First unassigned client with the same class, instance and role
+		for (i = 0; i < n; i++) {
+			if (t[i].set || t[i].c->isfullscreen) continue;
+			if (strcmp(t[i].id.class, id.class) || strcmp(t[i].id.instance, id.instance) ||
+				strcmp(t[i].id.role, id.role))
+				continue;
+
+			Monitor *mon = current_monitor ? current_monitor : monitors;
+			for (Monitor *m = monitors; m; m = m->next)
+				if (m->num == num) mon = m;
+			cell_geometry(mon, r1, c1, r2, c2, &t[i].x, &t[i].y, &t[i].w, &t[i].h);
+			t[i].mon = mon;
+			t[i].set = 1;
+			break;
+		}
+	}
+	fclose(f);
+
+	XGrabServer(dpy);
+	for (i = 0; i < n; i++) {
+		if (!t[i].set) continue;
+		resize(t[i].c, t[i].x, t[i].y, t[i].w, t[i].h);
+		// The client now belongs to whatever the target monitor shows
+		setclientws(t[i].c, t[i].mon->ws);
+		updatevisibility(t[i].c);
+	}
+	XUngrabServer(dpy);
+	XFlush(dpy);
+	free(t);
 
-	int x = mon->x + padding + c1 * (cell_w + padding);
-	int y = mon->y + padding + r1 * (cell_h + padding);
-	int w = cols_span * cell_w + (cols_span - 1) * padding;
-	int h = rows_span * cell_h + (rows_span - 1) * padding;
+	if (focused)
+		selmon(get_monitor_for_window(focused));
+}
 
-	resize(focused, x, y, w, h);
-	if (focused) focus(focused, 1);
+// FNV-1a
+static unsigned int strhash(const char *s) {
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
 }
 
-// Workspace functions
-static void switchws(const Arg *arg) {
-	int ws = arg->i;
-	if (ws < 0 || ws >= 9 || ws == current_ws) return;
-	
-	if (focused) {
-		last_focused[current_ws] = focused;
-	}
+static int gridlabel(char ch, int *r, int *c) {
+	for (*r = 0; *r < GRID_ROWS; (*r)++)
+		for (*c = 0; *c < GRID_COLS; (*c)++)
+			if (grid_chars[*r][*c] == ch)
+				return 1;
+	return 0;
+}
 
-	current_ws = ws;
-	
-	// Hide all windows from all workspaces
-	for (int i = 0; i < 9; i++) {
-		for (Client *c = workspaces[i]; c; c = c->next) {
-			XUnmapWindow(dpy, c->win);
-			c->mapped = 0;
+static void compilerules(void) {
+	char name[128];
+
+	for (int i = 0; i < RULEBUCKETS; i++)
+		rulebucket[i] = -1;
+	// Backwards, so that each chain ends up in rules[] order
+	for (int i = LENGTH(rules) - 1; i >= 0; i--) {
+		const Rule *r = &rules[i];
+		CompiledRule *cr = &crules[i];
+
+		// A rule that matches everything and does nothing would only hide
+		// the rules after it; that is the placeholder of an empty rules[]
+		if (!r->class && !r->instance && !r->role && !r->type &&
+			r->ws < 0 && r->monitor < 0 && !r->cells && !r->fullscreen) {
+			rulenext[i] = -1;
+			continue;
+		}
+		cr->hclass = r->class ? strhash(r->class) : 0;
+		cr->hinst = r->instance ? strhash(r->instance) : 0;
+		cr->hrole = r->role ? strhash(r->role) : 0;
+		cr->type = None;
+		if (r->type) {
+			snprintf(name, sizeof(name), "_NET_WM_WINDOW_TYPE_%s", r->type);
+			cr->type = XInternAtom(dpy, name, False);
+			rules_need |= RuleType;
+		}
+		if (r->role)
+			rules_need |= RuleRole;
+
+		int ra, ca, rb, cb;
+		cr->r1 = -1;
+		if (r->cells && gridlabel(r->cells[0], &ra, &ca) && gridlabel(r->cells[1], &rb, &cb)) {
+			cr->r1 = ra < rb ? ra : rb;
+			cr->r2 = ra < rb ? rb : ra;
+			cr->c1 = ca < cb ? ca : cb;
+			cr->c2 = ca < cb ? cb : ca;
+		} else if (r->cells) {
+			fprintf(stderr, "gbwm: rule %d: bad cells \"%s\"\n", i, r->cells);
 		}
-	}
-	
-	// Show current workspace windows
-	for (Client *c = workspaces[current_ws]; c; c = c->next) {
-		XMapWindow(dpy, c->win);
-		c->mapped = 1;
-	}
-	
-	// Restore the last focus on this WS, otherwise the first one
-	focused = last_focused[current_ws];
-	if (!focused) focused = workspaces[current_ws];
 
-	if (focused) {
-		focus(focused, 1);
-	} else {
-		XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
+		int *head = r->class ? &rulebucket[cr->hclass & (RULEBUCKETS - 1)] : &rulewild;
+		rulenext[i] = *head;
+		*head = i;
 	}
-
-	arrange();
 }
 
-static void movewin_to_ws(const Arg *arg) {
-	int ws = arg->i;
-	if (!focused || ws < 0 || ws >= 9 || ws == current_ws) return;
-	
-	Client *moving = focused;
-	
-	// Remove from current workspace
-	Client **prev;
-	for (prev = &workspaces[current_ws]; *prev; prev = &(*prev)->next) {
-		if (*prev == moving) {
-			*prev = moving->next;
-			break;
+// Index of the first rule matching win, or -1
+static int matchrule(Window win) {
+	XClassHint ch = {NULL, NULL};
+	XTextProperty tp = {0};
+	const char *class = "", *instance = "", *role = "";
+	Atom type = None;
+	int match = -1;
+
+	if (!XGetClassHint(dpy, win, &ch))
+		ch.res_class = ch.res_name = NULL;
+	if (ch.res_class) class = ch.res_class;
+	if (ch.res_name) instance = ch.res_name;
+	if ((rules_need & RuleRole) && XGetTextProperty(dpy, win, &tp, wm_window_role) &&
+		tp.value && tp.encoding == XA_STRING)
+		role = (char *)tp.value;
+	if (rules_need & RuleType) {
+		Atom real;
+		int format;
+		unsigned long n, after;
+		unsigned char *data = NULL;
+		if (XGetWindowProperty(dpy, win, net_wm_window_type, 0, 1, False, XA_ATOM,
+							   &real, &format, &n, &after, &data) == Success && data) {
+			if (n)
+				type = *(Atom *)data;
+			XFree(data);
 		}
 	}
-	
-	// Add to target workspace
-	moving->workspace = ws;
-	moving->next = workspaces[ws];
-	workspaces[ws] = moving;
-	moving->isfullscreen = 0;  // Reset fullscreen state
-	
-	// Hide the window we just moved
-	XUnmapWindow(dpy, moving->win);
-	moving->mapped = 0;
-	
-	// Update focus to next available window in current workspace
-	focused = workspaces[current_ws];
-	if (focused) {
-		focus(focused, 0);
-	} else {
-		focused = NULL;
+
+	unsigned int hc = strhash(class), hi = strhash(instance), hr = strhash(role);
+	int a = rulebucket[hc & (RULEBUCKETS - 1)], b = rulewild;
+	while (match < 0 && (a >= 0 || b >= 0)) {
+		// Walk both chains in rules[] order
+		int i = b < 0 || (a >= 0 && a < b) ? a : b;
+		if (i == a) a = rulenext[a]; else b = rulenext[b];
+
+		const Rule *r = &rules[i];
+		const CompiledRule *cr = &crules[i];
+		if ((!r->class || (cr->hclass == hc && !strcmp(r->class, class))) &&
+			(!r->instance || (cr->hinst == hi && !strcmp(r->instance, instance))) &&
+			(!r->role || (cr->hrole == hr && !strcmp(r->role, role))) &&
+			(!r->type || cr->type == type))
+			match = i;
 	}
-	
-	// Re-arrange current workspace
-	arrange();
+
+	if (ch.res_class) XFree(ch.res_class);
+	if (ch.res_name) XFree(ch.res_name);
+	if (tp.value) XFree(tp.value);
+	return match;
 }
 
 // Action functions
 static int sendevent(Client *c, Atom proto) {
-	int n;
-	Atom *protocols;
-	int exists = 0;
+	int exists = c->protocols & (proto == wm_delete_window ? ProtoDelete :
+								 proto == wm_take_focus ? ProtoTakeFocus : 0);
 	XEvent ev;
 
-	if (XGetWMProtocols(dpy, c->win, &protocols, &n)) {
-		while (!exists && n--)
-			exists = protocols[n] == proto;
-		XFree(protocols);
-	}
 	if (exists) {
 		ev.type = ClientMessage;
 		ev.xclient.window = c->win;
@@ -842,18 +2554,46 @@ static int sendevent(Client *c, Atom proto) {
 }
 
 static void killclient(const Arg *arg) {
-	if (!focused) return;
-	if (!sendevent(focused, wm_delete_window)) {
-		XGrabServer(dpy);
-		XSetCloseDownMode(dpy, DestroyAll);
-		XKillClient(dpy, focused->win);
+	int n, grabbed = 0;
+	Client **t = gettargets(&n);
+
+	for (int i = 0; i < n; i++) {
+		if (sendevent(t[i], wm_delete_window)) continue;
+		if (!grabbed) {
+			XGrabServer(dpy);
+			XSetCloseDownMode(dpy, DestroyAll);
+			grabbed = 1;
+		}
+		XKillClient(dpy, t[i]->win);
+	}
+	if (grabbed) {
 		XSync(dpy, False);
 		XUngrabServer(dpy);
 	}
+	endbatch();
+}
+
+// The fullscreen window shown on m, if any. Like cells[], it is only
+// looked up again after m's workspace changed, so the hot paths asking
+// for it (hover, restack, arrange) cost nothing.
+static Client *fullscreenon(Monitor *m) {
+	if (m->fs_ws != m->ws || m->fs_gen != wsgen[m->ws]) {
+		m->fullscreen = NULL;
+		for (Client *c = workspaces[m->ws]; c && !m->fullscreen; c = c->next)
+			if (c->isfullscreen && c->mapped && get_monitor_for_window(c) == m)
+				m->fullscreen = c;
+		m->fs_ws = m->ws;
+		m->fs_gen = wsgen[m->ws];
+	}
+	return m->fullscreen;
 }
 
+// Fullscreen windows cover their monitor without a border, are marked in
+// their own _NET_WM_STATE, and ask a compositor to unredirect them.
+// Until fullscreen ends, that monitor gets no hover focus, restacking,
+// arranging or border updates.
 static void setfullscreen(Client *c, int fullscreen) {
-	if (!c) return;
+	if (!c || !fullscreen == !c->isfullscreen) return;
 
 	Monitor *mon = get_monitor_for_window(c);
 	if (!mon) return;
@@ -866,33 +2606,38 @@ static void setfullscreen(Client *c, int fullscreen) {
 		c->saved_h = c->h;
 
 		c->isfullscreen = 1;
+		invalidate(c->workspace);
 
 		// Remove border and set to full screen on current monitor
 		XSetWindowBorderWidth(dpy, c->win, 0);
 		resize(c, mon->x, mon->y, mon->w, mon->h);
-		XRaiseWindow(dpy, c->win);
+		long bypass = 1;
+		XChangeProperty(dpy, c->win, net_wm_bypass_compositor, XA_CARDINAL, 32,
+						PropModeReplace, (unsigned char *)&bypass, 1);
+		// The hint can't undo our own redirection for thumbnails
+		if (have_thumbs)
+			XCompositeUnredirectWindow(dpy, c->win, CompositeRedirectAutomatic);
+		restack(mon);
 
 	} else if (!fullscreen && c->isfullscreen) {
 		// Restore saved position
 		c->isfullscreen = 0;
+		invalidate(c->workspace);
 
 		// Restore border
 		XSetWindowBorderWidth(dpy, c->win, border_width);
 
 		// Restore original position
 		resize(c, c->saved_x, c->saved_y, c->saved_w, c->saved_h);
+		XDeleteProperty(dpy, c->win, net_wm_bypass_compositor);
+		if (have_thumbs)
+			XCompositeRedirectWindow(dpy, c->win, CompositeRedirectAutomatic);
+		restack(get_monitor_for_window(c));
+		arrange_monitor(get_monitor_for_window(c));
 	}
 
-	// Update _NET_WM_STATE
-	XEvent ev;
-	ev.type = ClientMessage;
-	ev.xclient.window = c->win;
-	ev.xclient.message_type = XInternAtom(dpy, "_NET_WM_STATE", False);
-	ev.xclient.format = 32;
-	ev.xclient.data.l[0] = fullscreen ? 1 : 0;
-	ev.xclient.data.l[1] = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
-	ev.xclient.data.l[2] = 0;
-	XSendEvent(dpy, root, False, SubstructureNotifyMask | SubstructureRedirectMask, &ev);
+	// Update _NET_WM_STATE on the window itself
+	setclientstate(c);
 }
 
 static void toggle_fullscreen(const Arg *arg) {
@@ -900,27 +2645,156 @@ static void toggle_fullscreen(const Arg *arg) {
 	setfullscreen(focused, !focused->isfullscreen);
 }
 
-static void spawn(const Arg *arg) {
-	if (fork() == 0) {
+static pid_t startcmd(const char **cmd) {
+	pid_t pid = fork();
+	if (pid == 0) {
 		if (dpy)
 			close(ConnectionNumber(dpy));
 		setsid();
-		execvp(((char **)arg->v)[0], (char **)arg->v);
-		die("execvp %s failed", ((char **)arg->v)[0]);
+		execvp(cmd[0], (char **)cmd);
+		// _exit: the atexit handlers belong to the parent
+		fprintf(stderr, "gbwm: execvp %s failed\n", cmd[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+// Warm pools. Each pool keeps its command started up to size times, with
+// the first window of each instance held back: unmapped, or mapped
+// off-screen with park_hidden. Instances are matched to their window by
+// _NET_WM_PID, which is only read while some instance has no window yet.
+static struct { pid_t pid; Window win; Visual *visual; } warm[LENGTH(pools)][POOLMAX];
+static unsigned int nwarm[LENGTH(pools)];
+static int warm_waiting = 0;  // Started instances without a window yet
+static volatile sig_atomic_t warm_reaped = 0;  // A child exited; see reapwarm()
+
+static void fillpools(void) {
+	if (replaying) return;
+	for (unsigned int p = 0; p < LENGTH(pools); p++) {
+		unsigned int size = pools[p].size < POOLMAX ? pools[p].size : POOLMAX;
+		while (nwarm[p] < size) {
+			pid_t pid = startcmd(pools[p].cmd);
+			if (pid < 0) break;
+			warm[p][nwarm[p]].pid = pid;
+			warm[p][nwarm[p]].win = None;
+			nwarm[p]++;
+			warm_waiting++;
+		}
+	}
+}
+
+static void dropwarm(unsigned int p, unsigned int i) {
+	if (!warm[p][i].win)
+		warm_waiting--;
+	warm[p][i] = warm[p][--nwarm[p]];
+}
+
+// Hold back win if it is the first window of a warm instance
+static int holdwarm(Window win, XWindowAttributes *wa) {
+	Atom real;
+	int format;
+	unsigned long n, after;
+	unsigned char *data = NULL;
+	pid_t pid = 0;
+
+	if (!warm_waiting) return 0;
+	if (XGetWindowProperty(dpy, win, net_wm_pid, 0, 1, False, XA_CARDINAL,
+						   &real, &format, &n, &after, &data) == Success && data) {
+		if (n && format == 32)
+			pid = *(long *)data;
+		XFree(data);
+	}
+	if (!pid) return 0;
+
+	for (unsigned int p = 0; p < LENGTH(pools); p++)
+		for (unsigned int i = 0; i < nwarm[p]; i++) {
+			if (warm[p][i].pid != pid || warm[p][i].win) continue;
+			warm[p][i].win = win;
+			warm[p][i].visual = wa->visual;
+			warm_waiting--;
+			if (park_hidden) {
+				XMoveWindow(dpy, win, -(wa->width + 2 * wa->border_width) - 1, wa->y);
+				XMapWindow(dpy, win);
+			}
+			return 1;
+		}
+	return 0;
+}
+
+static int iswarm(Window win) {
+	for (unsigned int p = 0; p < LENGTH(pools); p++)
+		for (unsigned int i = 0; i < nwarm[p]; i++)
+			if (warm[p][i].win == win)
+				return 1;
+	return 0;
+}
+
+// A held window went away while its instance lives on, e.g. a splash
+// screen or a toolkit restart: wait for the instance's next window
+static void releasewarm(Window win) {
+	for (unsigned int p = 0; p < LENGTH(pools); p++)
+		for (unsigned int i = 0; i < nwarm[p]; i++)
+			if (warm[p][i].win == win) {
+				warm[p][i].win = None;
+				warm_waiting++;
+				return;
+			}
+}
+
+// Forget instances that exited (sigchld has reaped them) and start new ones
+static void reapwarm(void) {
+	warm_reaped = 0;
+	for (unsigned int p = 0; p < LENGTH(pools); p++)
+		for (unsigned int i = 0; i < nwarm[p]; i++)
+			if (kill(warm[p][i].pid, 0) < 0 && errno == ESRCH)
+				dropwarm(p, i--);
+	fillpools();
+}
+
+// Show a ready instance of cmd as a new window, if its pool has one
+static int takewarm(const char **cmd) {
+	for (unsigned int p = 0; p < LENGTH(pools); p++) {
+		if (pools[p].cmd != cmd) continue;
+		for (unsigned int i = 0; i < nwarm[p]; i++) {
+			if (!warm[p][i].win) continue;
+			Window win = warm[p][i].win;
+			Visual *visual = warm[p][i].visual;
+			dropwarm(p, i);
+			manage(win, visual);
+			fillpools();
+			return 1;
+		}
 	}
+	return 0;
+}
+
+static void spawn(const Arg *arg) {
+	if (replaying) return;
+	if (!takewarm((const char **)arg->v))
+		startcmd((const char **)arg->v);
 }
 
 static void quit(const Arg *arg) {
+	if (replaying) return;
+
+	// Warm instances were never shown; don't leave them running hidden
+	for (unsigned int p = 0; p < LENGTH(pools); p++)
+		for (unsigned int i = 0; i < nwarm[p]; i++)
+			kill(warm[p][i].pid, SIGTERM);
+
 	// Cleanup
 	while (monitors) {
 		Monitor *next = monitors->next;
-		free(monitors);
+		free_monitor(monitors);
 		monitors = next;
 	}
 	
 	for (int i = 0; i < 9; i++) {
 		while (workspaces[i]) {
 			Client *next = workspaces[i]->next;
+			// Don't leave parked windows off-screen
+			if (park_hidden && !workspaces[i]->mapped)
+				XMoveWindow(dpy, workspaces[i]->win, workspaces[i]->x, workspaces[i]->y);
 			free(workspaces[i]);
 			workspaces[i] = next;
 		}
@@ -931,66 +2805,268 @@ static void quit(const Arg *arg) {
 }
 
 static void cycle_focus(const Arg *arg) {
-	if (!workspaces[current_ws]) return;
+	Client *next = NULL;
+
+	// Next visible window after the focused one, wrapping around
+	if (focused && focused->workspace == current_ws)
+		for (next = focused->next; next && !next->mapped; next = next->next)
+			;
+	if (!next)
+		for (next = workspaces[current_ws]; next && !next->mapped; next = next->next)
+			;
+
+	if (next)
+		focus(next, 1);
+}
 
-	if (!focused) {
-		focus(workspaces[current_ws], 1);
-		return;
-	}
+static void cycle_focus_backward(const Arg *arg) {
+	Client *prev = NULL, *c;
+
+	// Find the previous visible window
+	for (c = workspaces[current_ws]; c && c != focused; c = c->next)
+		if (c->mapped)
+			prev = c;
 
-	Client *next = focused->next;
-	if (!next) next = workspaces[current_ws];
+	// If focused is the first, then prev = the last
+	if (!prev)
+		for (c = workspaces[current_ws]; c; c = c->next)
+			if (c->mapped)
+				prev = c;
 
-	focus(next, 1);
+	if (prev)
+		focus(prev, 1);
 }
 
-static void cycle_focus_backward(const Arg *arg) {
-	if (!workspaces[current_ws]) return;
+// Cell span (r1, c1)-(r2, c2) covered by c on mon
+static void spanof(Monitor *mon, Client *c, int *r1, int *c1, int *r2, int *c2) {
+	cell_at(mon, c->x, c->y, r1, c1);
+	cell_at(mon, c->x + c->w - 1, c->y + c->h - 1, r2, c2);
+}
+
+// The cell-to-client map of mon, rebuilt when its workspace has changed
+// since the last build. Fullscreen windows are left out; where windows
+// overlap, the one stacked higher owns the cell.
+static void buildcells(Monitor *mon) {
+	int r1, c1, r2, c2;
 
-	if (!focused) {
-		// If there is no focus, focus on the last window
-		Client *last = workspaces[current_ws];
-		while (last && last->next)
-			last = last->next;
-		focus(last, 1);
+	if (mon->cells_ws == mon->ws && mon->cells_gen == wsgen[mon->ws] &&
+		mon->cells_seq == stackseq)
 		return;
+	memset(mon->cells, 0, sizeof(mon->cells));
+	for (Client *c = workspaces[mon->ws]; c; c = c->next) {
+		if (!c->mapped || c->isfullscreen || !c->w || get_monitor_for_window(c) != mon)
+			continue;
+		spanof(mon, c, &r1, &c1, &r2, &c2);
+		for (int r = r1; r <= r2; r++)
+			for (int col = c1; col <= c2; col++)
+				if (!mon->cells[r][col] || mon->cells[r][col]->stackseq < c->stackseq)
+					mon->cells[r][col] = c;
 	}
+	mon->cells_ws = mon->ws;
+	mon->cells_gen = wsgen[mon->ws];
+	mon->cells_seq = stackseq;
+}
 
-	// Find the previous window
-	Client *prev = NULL;
-	for (Client *c = workspaces[current_ws]; c; c = c->next) {
-		if (c->next == focused) {
-			prev = c;
-			break;
+// Nearest client other than self next to the span (r1, c1)-(r2, c2) in
+// direction dir. Lines of cells are searched outward from the span; in
+// each line the cell closest to the middle of the span wins.
+static Client *cellneighbour(Monitor *mon, Client *self, int r1, int c1, int r2, int c2, int dir) {
+	int horiz = dir == DirLeft || dir == DirRight;
+	int step = dir == DirLeft || dir == DirUp ? -1 : 1;
+	int line = horiz ? (step < 0 ? c1 : c2) : (step < 0 ? r1 : r2);
+	int nlines = horiz ? GRID_COLS : GRID_ROWS;
+	int ncross = horiz ? GRID_ROWS : GRID_COLS;
+	int mid2 = horiz ? r1 + r2 : c1 + c2;  // Middle of the span, doubled
+
+	buildcells(mon);
+	for (line += step; line >= 0 && line < nlines; line += step) {
+		Client *best = NULL;
+		int bestd = 0;
+		for (int i = 0; i < ncross; i++) {
+			Client *c = horiz ? mon->cells[i][line] : mon->cells[line][i];
+			int d = abs(2 * i - mid2);
+			if (c && c != self && (!best || d < bestd)) {
+				best = c;
+				bestd = d;
+			}
 		}
+		if (best)
+			return best;
 	}
+	return NULL;
+}
 
-	// If focused is the first, then prev = the last
-	if (!prev) {
-		prev = workspaces[current_ws];
-		while (prev && prev->next)
-			prev = prev->next;
+// Closest monitor beyond mon's edge in direction dir
+static Monitor *adjacentmon(Monitor *mon, int dir) {
+	Monitor *best = NULL;
+	long bestd = 0;
+
+	for (Monitor *m = monitors; m; m = m->next) {
+		long gap, off;
+		switch (dir) {
+		case DirLeft:  gap = mon->x - (m->x + m->w); break;
+		case DirRight: gap = m->x - (mon->x + mon->w); break;
+		case DirUp:    gap = mon->y - (m->y + m->h); break;
+		default:       gap = m->y - (mon->y + mon->h); break;
+		}
+		if (m == mon || gap < 0) continue;
+		if (dir == DirLeft || dir == DirRight)
+			off = labs((long)(m->y + m->h / 2) - (mon->y + mon->h / 2));
+		else
+			off = labs((long)(m->x + m->w / 2) - (mon->x + mon->w / 2));
+		// Gap first, offset along the edge second
+		if (!best || gap * 65536 + off < bestd) {
+			best = m;
+			bestd = gap * 65536 + off;
+		}
+	}
+	return best;
+}
+
+// Place the search start just outside the grid, on the side opposite dir
+static void edgespan(int dir, int *r1, int *c1, int *r2, int *c2) {
+	switch (dir) {
+	case DirLeft:  *c1 = *c2 = GRID_COLS; break;
+	case DirRight: *c1 = *c2 = -1; break;
+	case DirUp:    *r1 = *r2 = GRID_ROWS; break;
+	default:       *r1 = *r2 = -1; break;
+	}
+}
+
+// The window next to the focused one in direction dir, continuing on the
+// adjacent monitor when there is none on this one. *to is set to the
+// adjacent monitor when the search crossed over to it.
+static Client *neighbour(int dir, Monitor **to) {
+	Monitor *mon = current_monitor;
+	Client *self = focused, *c;
+	int r1 = 0, c1 = 0, r2 = GRID_ROWS - 1, c2 = GRID_COLS - 1;
+
+	*to = NULL;
+	if (!mon) return NULL;
+	if (self && self->mapped && self->w && get_monitor_for_window(self) == mon) {
+		if (!self->isfullscreen)
+			spanof(mon, self, &r1, &c1, &r2, &c2);
+	} else {
+		self = NULL;
+		edgespan(dir, &r1, &c1, &r2, &c2);
+	}
+	if ((c = cellneighbour(mon, self, r1, c1, r2, c2, dir)))
+		return c;
+
+	if (!(mon = adjacentmon(mon, dir)))
+		return NULL;
+	*to = mon;
+	edgespan(dir, &r1, &c1, &r2, &c2);
+	return cellneighbour(mon, self, r1, c1, r2, c2, dir);
+}
+
+static void focusdir(const Arg *arg) {
+	Monitor *to;
+	Client *c = neighbour(arg->i, &to);
+
+	if (c) {
+		focus(c, 1);
+	} else if (to) {
+		// Nothing to focus over there; make the empty monitor current
+		selmon(to);
+		XWarpPointer(dpy, None, root, 0, 0, 0, 0, to->x + to->w / 2, to->y + to->h / 2);
 	}
+}
+
+// Swap the focused window with its neighbour in direction arg->i, or move
+// it onto the adjacent monitor if that shows no window to swap with
+static void swapdir(const Arg *arg) {
+	Client *self = focused;
+	Monitor *to, *from = current_monitor;
+	int x, y, w, h;
 
-	focus(prev, 1);
+	if (!self || !self->mapped || self->isfullscreen || get_monitor_for_window(self) != from)
+		return;
+	Client *c = neighbour(arg->i, &to);
+	if (c) {
+		x = c->x; y = c->y; w = c->w; h = c->h;
+		resize(c, self->x, self->y, self->w, self->h);
+		resize(self, x, y, w, h);
+		if (to) {
+			setclientws(c, self->workspace);
+			setclientws(self, to->ws);
+		}
+	} else if (to) {
+		int r1, c1, r2, c2;
+		spanof(from, self, &r1, &c1, &r2, &c2);
+		find_free_span(to, r2 - r1 + 1, c2 - c1 + 1, &r1, &c1, &r2, &c2);
+		cell_geometry(to, r1, c1, r2, c2, &x, &y, &w, &h);
+		resize(self, x, y, w, h);
+		setclientws(self, to->ws);
+	} else {
+		return;
+	}
+	restack(from);
+	focus(self, 1);
 }
 
 static void grabkeys(void) {
+	unsigned int nslots = 0;
+
+	memset(keytable, 0, sizeof(keytable));
+	memset(modslot, 0xff, sizeof(modslot));
+	memset(keychar, 0, sizeof(keychar));
+	memset(gridcell, -1, sizeof(gridcell));
+
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	for (unsigned int i = 0; i < sizeof(keys) / sizeof(Key); i++) {
 		KeyCode code = XKeysymToKeycode(dpy, keys[i].keysym);
-		if (code) {
-			XGrabKey(dpy, code, keys[i].mod, root, True,
-					 GrabModeAsync, GrabModeAsync);
-			XGrabKey(dpy, code, keys[i].mod | Mod2Mask, root, True,
-					 GrabModeAsync, GrabModeAsync);
+		unsigned int mod = CLEANMASK(keys[i].mod);
+		if (!code || !keys[i].func) continue;
+
+		if (modslot[mod] == 0xff) {
+			if (nslots == MODSLOTS) {
+				fprintf(stderr, "gbwm: too many modifier combinations, ignoring binding %u\n", i);
+				continue;
+			}
+			modslot[mod] = nslots++;
+		}
+		// First binding for a key wins, as with the old linear scan
+		if (!keytable[code][modslot[mod]])
+			keytable[code][modslot[mod]] = &keys[i];
+
+		XGrabKey(dpy, code, keys[i].mod, root, True,
+				 GrabModeAsync, GrabModeAsync);
+		XGrabKey(dpy, code, keys[i].mod | Mod2Mask, root, True,
+				 GrabModeAsync, GrabModeAsync);
+	}
+
+	// Overlay alphabet: grid char -> cell and keycode -> grid char
+	for (int r = 0; r < GRID_ROWS; r++) {
+		for (int c = 0; c < GRID_COLS; c++) {
+			unsigned char ch = (unsigned char)grid_chars[r][c];
+			KeyCode code = XKeysymToKeycode(dpy, (KeySym)ch);
+			gridcell[ch] = r * GRID_COLS + c;
+			if (code && !keychar[code]) {
+				keychar[code] = ch;
+				XGrabKey(dpy, code, place_mod, root, True,
+						 GrabModeAsync, GrabModeAsync);
+				XGrabKey(dpy, code, place_mod | Mod2Mask, root, True,
+						 GrabModeAsync, GrabModeAsync);
+			}
 		}
 	}
 }
 
+static void grabbuttons(void) {
+	XUngrabButton(dpy, AnyButton, AnyModifier, root);
+	for (unsigned int i = 0; i < sizeof(buttons) / sizeof(Button); i++) {
+		XGrabButton(dpy, buttons[i].button, buttons[i].mask, root, False,
+					ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+		XGrabButton(dpy, buttons[i].button, buttons[i].mask | Mod2Mask, root, False,
+					ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+	}
+}
+
 static void sigchld(int s) {
 	(void)s;
 	while (waitpid(-1, NULL, WNOHANG) > 0);
+	warm_reaped = 1;
 }
 
 int xerror_handler(Display *dpy, XErrorEvent *ee) {
@@ -1005,8 +3081,6 @@ static void setup_colors(void) {
 	XftColorAllocName(dpy, visual, cmap, col_foreground, &xft_col_foreground);
 	XftColorAllocName(dpy, visual, cmap, col_selection, &xft_col_selection);
 
-	font = XftFontOpenName(dpy, DefaultScreen(dpy), overlay_font);
-
 	// Allocate border colors
 	XColor color;
 	XParseColor(dpy, cmap, col_border_normal, &color);
@@ -1016,6 +3090,27 @@ static void setup_colors(void) {
 	XParseColor(dpy, cmap, col_border_focused, &color);
 	XAllocColor(dpy, cmap, &color);
 	border_focused = color.pixel;
+
+	XParseColor(dpy, cmap, col_border_marked, &color);
+	XAllocColor(dpy, cmap, &color);
+	border_marked = color.pixel;
+}
+
+// Open the overlay font and build the overlays. Opening an Xft font
+// initialises fontconfig, which can take hundreds of milliseconds, so the
+// main loop calls this once the event queue first runs dry rather than
+// during startup.
+static void load_font(void) {
+	if (font_loaded) return;
+
+	uint64_t t = now_ns();
+	font = XftFontOpenName(dpy, screen, overlay_font);
+	font_loaded = 1;
+
+	for (Monitor *m = monitors; m; m = m->next)
+		if (!m->overlay)
+			create_overlay(m);
+	fprintf(stderr, "gbwm: overlay font loaded in %.1f ms\n", (now_ns() - t) / 1e6);
 }
 
 static void setup_icccm(void) {
@@ -1023,6 +3118,39 @@ static void setup_icccm(void) {
 	wm_delete_window = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
 	wm_state = XInternAtom(dpy, "WM_STATE", False);
 	wm_take_focus = XInternAtom(dpy, "WM_TAKE_FOCUS", False);
+	wm_window_role = XInternAtom(dpy, "WM_WINDOW_ROLE", False);
+
+	net_wm_state = XInternAtom(dpy, "_NET_WM_STATE", False);
+	net_wm_state_hidden = XInternAtom(dpy, "_NET_WM_STATE_HIDDEN", False);
+	net_wm_state_fullscreen = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+	net_wm_window_type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
+	net_wm_sync_request = XInternAtom(dpy, "_NET_WM_SYNC_REQUEST", False);
+	net_wm_sync_request_counter = XInternAtom(dpy, "_NET_WM_SYNC_REQUEST_COUNTER", False);
+	net_wm_bypass_compositor = XInternAtom(dpy, "_NET_WM_BYPASS_COMPOSITOR", False);
+	net_wm_pid = XInternAtom(dpy, "_NET_WM_PID", False);
+}
+
+static void setup_sync(void) {
+	int error, major, minor;
+
+	have_sync = XSyncQueryExtension(dpy, &sync_event_base, &error) &&
+				XSyncInitialize(dpy, &major, &minor);
+}
+
+// Thumbnails need the window contents kept off-screen (Composite 0.2 for
+// named pixmaps) and change notification (Damage)
+static void setup_thumbnails(void) {
+	int event, error, major = 0, minor = 2;
+
+	if (!XCompositeQueryExtension(dpy, &event, &error) ||
+		!XCompositeQueryVersion(dpy, &major, &minor) || (major == 0 && minor < 2) ||
+		!XDamageQueryExtension(dpy, &damage_event_base, &error)) {
+		fprintf(stderr, "gbwm: no Composite/Damage, overlay thumbnails disabled\n");
+		return;
+	}
+	XCompositeRedirectSubwindows(dpy, root, CompositeRedirectAutomatic);
+	rootfmt = XRenderFindVisualFormat(dpy, DefaultVisual(dpy, screen));
+	have_thumbs = 1;
 }
 
 static void setrootbackground(void) {
@@ -1036,6 +3164,315 @@ static void setrootbackground(void) {
 	}
 }
 
+// Event log format: "GBWMREC1", the recording root window (64 bit), then
+// per event a 64 bit monotonic timestamp in ns, a 16 bit length and the
+// leading length bytes of the XEvent. All fields are in host byte order.
+#define REC_MAGIC "GBWMREC1"
+#define REPLAY_WINS 1024
+
+static struct { Window rec, live; } replay_wins[REPLAY_WINS];
+static int nreplay_wins = 0;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t eventsize(int type) {
+	switch (type) {
+		case KeyPress: return sizeof(XKeyEvent);
+		case ButtonPress: return sizeof(XButtonEvent);
+		case EnterNotify: return sizeof(XCrossingEvent);
+		case Expose: return sizeof(XExposeEvent);
+		case MapRequest: return sizeof(XMapRequestEvent);
+		case ConfigureRequest: return sizeof(XConfigureRequestEvent);
+		case PropertyNotify: return sizeof(XPropertyEvent);
+		case UnmapNotify: return sizeof(XUnmapEvent);
+		case DestroyNotify: return sizeof(XDestroyWindowEvent);
+		case ClientMessage: return sizeof(XClientMessageEvent);
+		case MappingNotify: return sizeof(XMappingEvent);
+		default: return sizeof(XEvent);
+	}
+}
+
+static const char *eventname(int type) {
+	static const char *names[LASTEvent] = {
+		[KeyPress] = "KeyPress", [ButtonPress] = "ButtonPress",
+		[EnterNotify] = "EnterNotify", [Expose] = "Expose",
+		[MapRequest] = "MapRequest", [ConfigureRequest] = "ConfigureRequest",
+		[UnmapNotify] = "UnmapNotify", [PropertyNotify] = "PropertyNotify",
+		[DestroyNotify] = "DestroyNotify", [ClientMessage] = "ClientMessage",
+		[MappingNotify] = "MappingNotify",
+	};
+	return type >= 0 && type < LASTEvent && names[type] ? names[type] : "other";
+}
+
+static void record_close(void) {
+	if (recfile) {
+		fclose(recfile);
+		recfile = NULL;
+	}
+}
+
+static void record_open(const char *path) {
+	uint64_t rootid = root;
+
+	if (!(recfile = fopen(path, "wb")))
+		die("cannot open %s for recording", path);
+	fwrite(REC_MAGIC, 1, 8, recfile);
+	fwrite(&rootid, sizeof(rootid), 1, recfile);
+	atexit(record_close);
+}
+
+static void record_event(XEvent *ev) {
+	uint64_t t = now_ns();
+	uint16_t len = (uint16_t)eventsize(ev->type);
+
+	fwrite(&t, sizeof(t), 1, recfile);
+	fwrite(&len, sizeof(len), 1, recfile);
+	fwrite(ev, len, 1, recfile);
+}
+
+// Map a window id from the recording to one on the replay server. Windows
+// are created on the MapRequest that introduces them; unknown ids pass
+// through unchanged and simply match no client.
+static Window replay_window(Window w, int create) {
+	for (int i = 0; i < nreplay_wins; i++)
+		if (replay_wins[i].rec == w)
+			return replay_wins[i].live;
+	if (!create || nreplay_wins == REPLAY_WINS)
+		return w;
+
+	replay_wins[nreplay_wins].rec = w;
+	replay_wins[nreplay_wins].live = XCreateSimpleWindow(dpy, root, 0, 0, 100, 100, 0, 0, 0);
+	return replay_wins[nreplay_wins++].live;
+}
+
+static void replay_translate(XEvent *ev) {
+	ev->xany.display = dpy;
+	ev->xany.window = replay_window(ev->xany.window, 0);
+
+	switch (ev->type) {
+		case KeyPress:
+		case ButtonPress:
+			// XKeyEvent and XButtonEvent share their leading layout
+			ev->xbutton.root = root;
+			ev->xbutton.subwindow = replay_window(ev->xbutton.subwindow, 0);
+			break;
+		case EnterNotify:
+			ev->xcrossing.root = root;
+			ev->xcrossing.subwindow = replay_window(ev->xcrossing.subwindow, 0);
+			break;
+		case MapRequest:
+			ev->xmaprequest.window = replay_window(ev->xmaprequest.window, 1);
+			break;
+		case ConfigureRequest:
+			ev->xconfigurerequest.window = replay_window(ev->xconfigurerequest.window, 0);
+			ev->xconfigurerequest.above = replay_window(ev->xconfigurerequest.above, 0);
+			break;
+		case UnmapNotify:
+			ev->xunmap.window = replay_window(ev->xunmap.window, 0);
+			break;
+		case DestroyNotify:
+			ev->xdestroywindow.window = replay_window(ev->xdestroywindow.window, 0);
+			break;
+	}
+}
+
+// Feed a recorded event log through the handlers as fast as possible and
+// report the time and X traffic per event type. Meant to be run against
+// Xvfb; returns non-zero if a handler went over its round-trip budget.
+static int replay(const char *path) {
+	struct { uint64_t count, total, max; } stats[LASTEvent + 1] = {{0}};
+	char magic[8];
+	uint64_t rootid, t;
+	uint16_t len;
+	XEvent ev;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb")))
+		die("cannot open %s", path);
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, REC_MAGIC, 8) ||
+		fread(&rootid, sizeof(rootid), 1, f) != 1)
+		die("%s: not a gbwm event log", path);
+
+	replay_wins[nreplay_wins].rec = (Window)rootid;
+	replay_wins[nreplay_wins++].live = root;
+	replaying = 1;
+	// A live session loads the font at first idle, before any key is typed
+	load_font();
+
+	uint64_t start = now_ns();
+	while (fread(&t, sizeof(t), 1, f) == 1 && fread(&len, sizeof(len), 1, f) == 1) {
+		memset(&ev, 0, sizeof(ev));
+		if (len > sizeof(ev) || fread(&ev, len, 1, f) != 1)
+			die("%s: truncated event log", path);
+		replay_translate(&ev);
+
+		// Drop what the server sent us in response to earlier events
+		while (XPending(dpy)) {
+			XEvent discard;
+			XNextEvent(dpy, &discard);
+		}
+
+		int slot = ev.type >= 0 && ev.type < LASTEvent ? ev.type : LASTEvent;
+		if (ev.type == rr_event_base + RRScreenChangeNotify) slot = LASTEvent;
+		uint64_t t0 = now_ns();
+		handleevent(&ev);
+		// Each replayed event is a batch of its own
+		flushconfigs();
+		if (screen_deadline)
+			monitorschanged();
+		XSync(dpy, False);
+		uint64_t dt = now_ns() - t0;
+
+		stats[slot].count++;
+		stats[slot].total += dt;
+		if (dt > stats[slot].max) stats[slot].max = dt;
+	}
+	uint64_t elapsed = now_ns() - start;
+	fclose(f);
+
+	printf("%-22s %8s %12s %10s %10s\n", "event", "count", "total ms", "avg us", "max us");
+	for (int i = 0; i <= LASTEvent; i++) {
+		if (!stats[i].count) continue;
+		printf("%-22s %8llu %12.3f %10.1f %10.1f\n",
+			   i == LASTEvent ? "RRScreenChangeNotify" : eventname(i),
+			   (unsigned long long)stats[i].count, stats[i].total / 1e6,
+			   stats[i].total / 1e3 / stats[i].count, stats[i].max / 1e3);
+	}
+	printf("replayed in %.3f ms\n\n", elapsed / 1e6);
+	dumpstats(stdout);
+	return checkbudgets(stdout);
+}
+
+// Wait until an event is pending or the deadline (ns) passes; returns 0 on timeout
+static int waitevent(uint64_t deadline) {
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+
+	while (!XPending(dpy)) {
+		uint64_t t = now_ns();
+		if (t >= deadline)
+			return 0;
+		int ms = deadline == UINT64_MAX ? -1 : (int)((deadline - t + 999999) / 1000000);
+		if (poll(&pfd, 1, ms) < 0 && errno == EINTR)
+			return 0;  // interrupted by a signal
+	}
+	return 1;
+}
+
+// Startup phase timing, reported once setup is done
+static char startup_log[256];
+static uint64_t phase_start;
+
+static void startup_phase(const char *name) {
+	uint64_t t = now_ns();
+	size_t len = strlen(startup_log);
+	snprintf(startup_log + len, sizeof(startup_log) - len, " %s %.1fms",
+			 name, (t - phase_start) / 1e6);
+	phase_start = t;
+}
+
+static void handleevent(XEvent *ev) {
+	unsigned long req, rt;
+	int slot = ev->type == rr_event_base + RRScreenChangeNotify ? LASTEvent :
+			   ev->type >= 0 && ev->type < LASTEvent ? ev->type : -1;
+
+	if (recfile)
+		record_event(ev);
+
+	account_begin(&req, &rt);
+	switch (ev->type) {
+		case ButtonPress: buttonpress(ev); break;
+		case ClientMessage: clientmessage(ev); break;
+		case MapRequest: maprequest(ev); break;
+		case ConfigureRequest: configurerequest(ev); break;
+		case UnmapNotify: unmapnotify(ev); break;
+		case DestroyNotify: destroynotify(ev); break;
+		case EnterNotify: enternotify(ev); break;
+		case KeyPress: keypress(ev); break;
+		case MappingNotify: mappingnotify(ev); break;
+		case Expose: expose(ev); break;
+		case PropertyNotify: propertynotify(ev); break;
+	}
+
+	if (have_thumbs && ev->type == damage_event_base + XDamageNotify)
+		damagenotify(ev);
+	if (have_sync && ev->type == sync_event_base + XSyncAlarmNotify)
+		syncnotify(ev);
+
+	// Handle RandR screen change events
+	if (ev->type == rr_event_base + RRScreenChangeNotify) {
+		screenchange(ev);
+	}
+	if (slot >= 0)
+		account_end(&evstats[slot], req, rt);
+}
+
+// The list walk is_cell_free() did before the packed kernels; kept as
+// the reference for the -b benchmark
+static int bench_cell_free_list(Monitor *mon, int x0, int y0, int x1, int y1) {
+	for (Client *cl = workspaces[mon->ws]; cl; cl = cl->next) {
+		if (cl->isfullscreen) continue;
+		if (!(cl->x + cl->w <= x0 || cl->x >= x1 || cl->y + cl->h <= y0 || cl->y >= y1))
+			return 0;
+	}
+	return 1;
+}
+
+// Offline microbenchmark of the cell hit test: n small random windows on
+// one monitor, random rectangles queried through both paths. Most queries
+// miss, so both paths walk every window.
+static void bench(int n) {
+	Monitor mon = { .x = 0, .y = 0, .w = 3840, .h = 2160, .ws = 0 };
+	const int qw = 32, qh = 32;
+	enum { Queries = 200000 };
+	static int qx[Queries], qy[Queries];
+	int free_list = 0, free_vec = 0;
+
+	srand(1);
+	for (int i = 0; i < n; i++) {
+		Client *c = calloc(1, sizeof(Client));
+		c->x = rand() % mon.w;
+		c->y = rand() % mon.h;
+		c->w = 1 + rand() % 4;
+		c->h = 1 + rand() % 4;
+		c->isfullscreen = rand() % 16 == 0;
+		c->next = workspaces[0];
+		workspaces[0] = c;
+	}
+	for (int i = 0; i < Queries; i++) {
+		qx[i] = rand() % mon.w;
+		qy[i] = rand() % mon.h;
+	}
+
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < Queries; i++)
+		free_list += bench_cell_free_list(&mon, qx[i], qy[i], qx[i] + qw, qy[i] + qh);
+	uint64_t t1 = now_ns();
+	clientrects(0);
+	uint64_t t2 = now_ns();
+	for (int i = 0; i < Queries; i++)
+		free_vec += !rects_overlap(clientrects(0), qx[i], qy[i],
+								   qx[i] + qw, qy[i] + qh, RectFullscreen);
+	uint64_t t3 = now_ns();
+
+#if defined(__AVX2__)
+	const char *path = "avx2";
+#elif defined(__SSE2__)
+	const char *path = "sse2";
+#else
+	const char *path = "scalar";
+#endif
+	printf("%d windows, %d queries, %d free\n", n, Queries, free_vec);
+	printf("list: %.1f ns/query\n", (double)(t1 - t0) / Queries);
+	printf("%s: %.1f ns/query, %.1f us to pack\n", path,
+		   (double)(t3 - t2) / Queries, (t2 - t1) / 1e3);
+	if (free_list != free_vec)
+		die("gbwm: bench mismatch: list %d, packed %d", free_list, free_vec);
+}
+
 void die(const char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
@@ -1046,62 +3483,118 @@ void die(const char *fmt, ...) {
 }
 
 int main(int argc, char *argv[]) {
+	const char *recpath = NULL, *replaypath = NULL;
+
 	if (argc == 2 && !strcmp("-v", argv[1]))
 		die("gbwm v"VERSION);
+	else if (argc == 3 && !strcmp("-r", argv[1]))
+		recpath = argv[2];
+	else if (argc == 3 && !strcmp("-p", argv[1]))
+		replaypath = argv[2];
+	else if ((argc == 2 || argc == 3) && !strcmp("-b", argv[1])) {
+		bench(argc == 3 ? atoi(argv[2]) : 1000);
+		return 0;
+	}
 	else if (argc != 1)
-		die("Usage: gbwm [-v]");
+		die("Usage: gbwm [-v] [-r eventlog | -p eventlog | -b [nwindows]]");
+
+	uint64_t start = phase_start = now_ns();
 	if (!getenv("DISPLAY"))
 		die("DISPLAY environment variable not set");
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("cannot open X11 display (is X running?)");
 
 	signal(SIGCHLD, sigchld);
+	signal(SIGUSR1, sigusr1);
+	signal(SIGTERM, sigterm);
 	XSetErrorHandler(xerror_handler);
+	XSetAfterFunction(dpy, countroundtrip);
 
 	screen = DefaultScreen(dpy);
 	sw = DisplayWidth(dpy, screen);
 	sh = DisplayHeight(dpy, screen);
 	root = RootWindow(dpy, screen);
+	startup_phase("display");
+
+	// Take over the root window first so no MapRequest is missed while
+	// the rest of the setup runs; events queue up until the main loop.
+	XSelectInput(dpy, root,
+		SubstructureRedirectMask | SubstructureNotifyMask |
+		EnterWindowMask | LeaveWindowMask | FocusChangeMask |
+		StructureNotifyMask | PropertyChangeMask);
+	// Enable RandR screen change notifications
+	int rr_error_base;
+	if (XRRQueryExtension(dpy, &rr_event_base, &rr_error_base))
+		XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
+	startup_phase("redirect");
+
 	Cursor cursor = XCreateFontCursor(dpy, XC_left_ptr);
 	XDefineCursor(dpy, root, cursor);
-
 	setup_colors();
 	setrootbackground();
 	setup_icccm();
+	setup_sync();
+	if (overlay_thumbnails)
+		setup_thumbnails();
+	startup_phase("colors");
+
 	update_monitors();
 	
 	if (!current_monitor && monitors) {
-		current_monitor = monitors;
+		selmon(monitors);
 	}
-
-	// Enable RandR screen change notifications
-	XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
-
-	XSelectInput(dpy, root,
-		SubstructureRedirectMask | SubstructureNotifyMask |
-		EnterWindowMask | LeaveWindowMask | FocusChangeMask |
-		StructureNotifyMask | PropertyChangeMask);
+	startup_phase("monitors");
 
 	grabkeys();
+	grabbuttons();
+	compilerules();
+	startup_phase("bindings");
+	fprintf(stderr, "gbwm: startup%s, total %.1fms\n", startup_log, (now_ns() - start) / 1e6);
+
+	if (replaypath) {
+		int over = replay(replaypath);
+		XCloseDisplay(dpy);
+		return over;
+	}
+	if (recpath)
+		record_open(recpath);
+	fillpools();
 
 	XEvent ev;
 	while (1) {
-		XNextEvent(dpy, &ev);
-		switch (ev.type) {
-			case ButtonPress: buttonpress(&ev); break;
-			case ClientMessage: clientmessage(&ev); break;
-			case MapRequest: maprequest(&ev); break;
-			case UnmapNotify: unmapnotify(&ev); break;
-			case DestroyNotify: destroynotify(&ev); break;
-			case EnterNotify: enternotify(&ev); break;
-			case KeyPress: keypress(&ev); break;
-			case Expose: expose(&ev); break;
-		}
-		
-		// Handle RandR screen change events
-		if (ev.type == RRNotify + RRScreenChangeNotify) {
-			screenchange(&ev);
+		if (npendingcfg && !XPending(dpy))
+			flushconfigs();
+		if (!font_loaded && !XPending(dpy))
+			load_font();
+		if (warm_reaped)
+			reapwarm();
+		if (dumpstats_pending) {
+			dumpstats_pending = 0;
+			dumpstats(stderr);
 		}
+		if (quit_pending)
+			quit(NULL);  // exits through record_close
+		// Keep the capture complete up to the last event in case we are killed
+		if (recfile && !XPending(dpy))
+			fflush(recfile);
+
+		uint64_t t = now_ns(), deadline = UINT64_MAX;
+		if (chord_deadline && t >= chord_deadline)
+			chordtimeout();
+		if (screen_deadline && t >= screen_deadline)
+			monitorschanged();
+		if (sync_deadline && t >= sync_deadline)
+			synctimeout();
+		if (chord_deadline)
+			deadline = chord_deadline;
+		if (screen_deadline && screen_deadline < deadline)
+			deadline = screen_deadline;
+		if (sync_deadline && sync_deadline < deadline)
+			deadline = sync_deadline;
+		if (!waitevent(deadline))
+			continue;
+		XNextEvent(dpy, &ev);
+		handleevent(&ev);
 	}
 
 	XCloseDisplay(dpy);
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Replay an event log on a scratch Xvfb server. Fails when a handler or
+# key action goes over its round-trip budget, see budgets[] in gbwm.c.
+#
+#   tests/check.sh ./gbwm tests/session.log
+
+gbwm=${1:-./gbwm}
+log=${2:-tests/session.log}
+
+command -v Xvfb >/dev/null || { echo "check: Xvfb not found" >&2; exit 1; }
+
+displayfile=$(mktemp) || exit 1
+Xvfb -displayfd 3 -screen 0 1920x1080x24 -nolisten tcp 3>"$displayfile" 2>/dev/null &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null; rm -f "$displayfile"' EXIT
+
+# Xvfb writes the display number once it accepts connections
+for i in $(seq 50); do
+	[ -s "$displayfile" ] && break
+	sleep 0.1
+done
+if [ ! -s "$displayfile" ]; then
+	echo "check: Xvfb did not start" >&2
+	exit 1
+fi
+
+DISPLAY=:$(cat "$displayfile") "$gbwm" -p "$log"
+status=$?
+[ $status -eq 0 ] && echo "check: all handlers within budget" || echo "check: FAILED" >&2
+exit $status
@@ -0,0 +1,153 @@
+// Writes tests/session.log, the event log replayed by `make check`.
+// The session is scripted rather than recorded so that it can be rebuilt
+// on any ABI: gbwm logs raw XEvent structs, whose layout depends on it.
+// Keycodes are those of the evdev keymap Xvfb starts with.
+//
+//   cc -o mksession tests/mksession.c && ./mksession tests/session.log
+
+#include <X11/Xlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROOT   0x7b0
+#define WIN(n) (0x1000000 + (n))
+
+#define MOD 0x40  // Mod4Mask, MODKEY in def.config.h
+
+enum { KcEsc = 9, KcSpace = 65, KcTab = 23, KcF = 41, KcJ = 44, KcK = 45, KcM = 58,
+	   Kc1 = 10, Kc2 = 11, KcLeft = 113, KcRight = 114 };
+
+static FILE *out;
+static uint64_t now = 1000000000;
+
+static void emit(XEvent *ev, size_t len) {
+	uint16_t n = (uint16_t)len;
+	now += 20000000;  // 20ms apart
+	fwrite(&now, sizeof(now), 1, out);
+	fwrite(&n, sizeof(n), 1, out);
+	fwrite(ev, len, 1, out);
+}
+
+static void maprequest(Window w) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xmaprequest.type = MapRequest;
+	ev.xmaprequest.parent = ROOT;
+	ev.xmaprequest.window = w;
+	emit(&ev, sizeof(XMapRequestEvent));
+}
+
+static void configurerequest(Window w, int width, int height) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xconfigurerequest.type = ConfigureRequest;
+	ev.xconfigurerequest.parent = ROOT;
+	ev.xconfigurerequest.window = w;
+	ev.xconfigurerequest.width = width;
+	ev.xconfigurerequest.height = height;
+	ev.xconfigurerequest.value_mask = CWWidth | CWHeight;
+	emit(&ev, sizeof(XConfigureRequestEvent));
+}
+
+static void enter(Window w) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xcrossing.type = EnterNotify;
+	ev.xcrossing.window = w;
+	ev.xcrossing.root = ROOT;
+	ev.xcrossing.mode = NotifyNormal;
+	ev.xcrossing.detail = NotifyNonlinear;
+	ev.xcrossing.same_screen = True;
+	emit(&ev, sizeof(XCrossingEvent));
+}
+
+static void property(Window w, Atom atom) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xproperty.type = PropertyNotify;
+	ev.xproperty.window = w;
+	ev.xproperty.atom = atom;
+	ev.xproperty.state = PropertyNewValue;
+	emit(&ev, sizeof(XPropertyEvent));
+}
+
+static void key(unsigned int state, unsigned int keycode) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xkey.type = KeyPress;
+	ev.xkey.window = ROOT;
+	ev.xkey.root = ROOT;
+	ev.xkey.state = state;
+	ev.xkey.keycode = keycode;
+	ev.xkey.same_screen = True;
+	emit(&ev, sizeof(XKeyEvent));
+}
+
+static void unmap(Window w) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xunmap.type = UnmapNotify;
+	ev.xunmap.event = ROOT;
+	ev.xunmap.window = w;
+	emit(&ev, sizeof(XUnmapEvent));
+}
+
+static void destroy(Window w) {
+	XEvent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.xdestroywindow.type = DestroyNotify;
+	ev.xdestroywindow.event = ROOT;
+	ev.xdestroywindow.window = w;
+	emit(&ev, sizeof(XDestroyWindowEvent));
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t root = ROOT;
+
+	if (argc != 2 || !(out = fopen(argv[1], "wb"))) {
+		fprintf(stderr, "usage: mksession <log>\n");
+		return 1;
+	}
+	fwrite("GBWMREC1", 1, 8, out);
+	fwrite(&root, sizeof(root), 1, out);
+
+	// Three windows open, one asks for a size of its own
+	for (int i = 1; i <= 3; i++)
+		maprequest(WIN(i));
+	configurerequest(WIN(2), 400, 300);
+	enter(WIN(1));
+	property(WIN(1), 39);  // WM_NAME
+
+	// Focus by cycling and by direction, then swap
+	key(MOD, KcJ);
+	key(MOD, KcK);
+	key(MOD, KcTab);
+	key(MOD | ShiftMask, KcTab);
+	key(MOD, KcRight);
+	key(MOD, KcLeft);
+	key(MOD | ShiftMask, KcRight);
+
+	// Open the overlay and leave it again
+	key(MOD, KcSpace);
+	key(0, KcEsc);
+
+	// Mark, fullscreen and back, move to workspace 2, visit it and return
+	key(MOD, KcM);
+	key(MOD | ShiftMask, KcM);
+	key(MOD, KcF);
+	key(MOD, KcF);
+	key(MOD | ShiftMask, Kc2);
+	key(MOD, Kc2);
+	enter(WIN(1));
+	key(MOD, Kc1);
+
+	// One window goes away, another one opens
+	unmap(WIN(3));
+	destroy(WIN(3));
+	maprequest(WIN(4));
+	enter(WIN(4));
+
+	return fclose(out) != 0;
+}